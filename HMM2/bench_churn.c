@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "heap.h"
+
+/* Define benchmark parameters */
+#define NUM_SLOTS 2048 /* Live blocks */
+#define MAX_ITERATIONS 2000000 /* Number of allocation and deallocation operations */
+
+/* The handful of hot sizes our services free and reallocate constantly */
+static const size_t hotSizes[] = {24, 40, 72, 96, 136, 200};
+#define NUM_HOT_SIZES (sizeof(hotSizes) / sizeof(hotSizes[0]))
+
+int main() {
+    static void* pointers[NUM_SLOTS];
+    unsigned int seed = 7;
+    struct timespec start, end;
+    hmmStats stats;
+    const char* percpu = getenv("HMM_PERCPU");
+    const char* quick = getenv("HMM_QUICKBINS");
+
+    printf("Churn benchmark (per-CPU caches %s, quick bins %s)\n",
+           (percpu && strcmp(percpu, "0") == 0) ? "off" : "on",
+           (quick && strcmp(quick, "0") == 0) ? "off" : "on");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < MAX_ITERATIONS; ++i) {
+        int index = rand_r(&seed) % NUM_SLOTS;
+        if (pointers[index] == NULL) {
+            pointers[index] = HmmAlloc(hotSizes[rand_r(&seed) % NUM_HOT_SIZES]);
+        } else {
+            HmmFree(pointers[index]);
+            pointers[index] = NULL;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    HmmGetStats(&stats);
+    size_t lookups = stats.quickHits + stats.quickMisses;
+
+    printf("throughput      %.2f Mops/s\n", MAX_ITERATIONS / seconds / 1e6);
+    printf("quick bin hits  %zu / %zu (%.1f%%)\n", stats.quickHits, lookups,
+           lookups ? 100.0 * stats.quickHits / lookups : 0.0);
+    printf("consolidations  %zu\n", stats.consolidations);
+    printf("heap size       %zu bytes\n", stats.heapBytes);
+
+    for (int i = 0; i < NUM_SLOTS; ++i) {
+        HmmFree(pointers[i]);
+    }
+    return 0;
+}
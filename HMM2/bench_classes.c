@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "heap.h"
+
+/* Define benchmark parameters */
+#define NUM_REQUESTS 200000 /* Requests drawn per workload */
+#define MAX_HOT_SIZES 8
+
+typedef struct Workload {
+    const char* name;
+    size_t minSize;               /* Uniform range, used when there are no hot sizes */
+    size_t maxSize;
+    size_t hotSizes[MAX_HOT_SIZES];
+} Workload;
+
+/* The workloads of the other benchmarks, plus records mostly above the default classes */
+static const Workload workloads[] = {
+    {"churn", 0, 0, {24, 40, 72, 96, 136, 200}},
+    {"16 B", 0, 0, {16}},
+    {"72 B", 0, 0, {72}},
+    {"200 B", 0, 0, {200}},
+    {"1-256 B", 1, 256, {0}},
+    {"1-1016 B", 1, HMM_SMALL_MAX, {0}},
+    {"1-4096 B", 1, 4096, {0}},
+    {"records", 0, 0, {48, 280, 320, 520, 656, 900}},
+};
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+static size_t drawSize(const Workload* load, unsigned int* seed) {
+    if (load->hotSizes[0] == 0) {
+        return load->minSize + (size_t)rand_r(seed) % (load->maxSize - load->minSize + 1);
+    }
+
+    int hot = 0;
+    while (hot < MAX_HOT_SIZES && load->hotSizes[hot] != 0) {
+        hot++;
+    }
+    return load->hotSizes[rand_r(seed) % hot];
+}
+
+/* Percentage of all requests a table of `count` classes serves from a class */
+static double cachedShare(const size_t* counts, const size_t* sizes, int count) {
+    size_t cached = 0;
+
+    for (size_t size = 0; size <= sizes[count - 1]; ++size) {
+        cached += counts[size];
+    }
+    return 100.0 * cached / NUM_REQUESTS;
+}
+
+int main() {
+    static size_t counts[HMM_CLASS_BUCKETS];
+    size_t current[HMM_SIZE_CLASSES], tuned[HMM_SIZE_CLASSES];
+    int tunedClasses = 0;
+    unsigned int seed = 5;
+
+    HmmFree(HmmAlloc(1));  // Initialize the heap so that a table from HMM_CLASS_PROFILE is in use
+    int classes = classTableGet(current);
+    printf("Internal fragmentation of requests up to %zu B, bytes per request (%% of requested),\n", (size_t)HMM_SMALL_MAX);
+    printf("and the share of all requests served from a size class\n");
+    printf("%-10s %24s %24s\n", "workload", "table in use", "tuned");
+    for (size_t w = 0; w < NUM_WORKLOADS; ++w) {
+        size_t small = 0, requested = 0;
+
+        memset(counts, 0, sizeof(counts));
+        for (int i = 0; i < NUM_REQUESTS; ++i) {
+            size_t size = drawSize(&workloads[w], &seed);
+            if (size <= HMM_SMALL_MAX) {
+                counts[size]++;
+                requested += size;
+                small++;
+            }
+        }
+
+        tunedClasses = classTune(counts, tuned);
+        double before = classWaste(counts, current, classes), after = classWaste(counts, tuned, tunedClasses);
+        printf("%-10s %5.1f (%5.1f%%) %4.0f%% cached %5.1f (%5.1f%%) %4.0f%% cached\n", workloads[w].name,
+               before / small, 100.0 * before / requested, cachedShare(counts, current, classes),
+               after / small, 100.0 * after / requested, cachedShare(counts, tuned, tunedClasses));
+    }
+
+    // The table tuned on the last workload, in the format HMM_CLASS_PROFILE reads
+    printf("\nrecords profile:\n");
+    for (int cls = 0; cls < tunedClasses; ++cls) {
+        printf("%zu%c", tuned[cls], (cls % 8 == 7 || cls == tunedClasses - 1) ? '\n' : ' ');
+    }
+    return 0;
+}
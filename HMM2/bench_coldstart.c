@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "heap.h"
+
+/* Define benchmark parameters */
+#define NUM_ALLOCATIONS 20000 /* First allocations of the process, then the same again once warm */
+#define MAX_SMALL_SIZE 256 /* Most requests hit the size classes */
+#define MAX_LARGE_SIZE 4096
+
+static long long elapsedNs(struct timespec* start, struct timespec* end) {
+    return (end->tv_sec - start->tv_sec) * 1000000000LL + (end->tv_nsec - start->tv_nsec);
+}
+
+static int compareLatency(const void* a, const void* b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char* name, long long* samples, int count) {
+    long long total = 0;
+    for (int i = 0; i < count; ++i) {
+        total += samples[i];
+    }
+    qsort(samples, count, sizeof(long long), compareLatency);
+    printf("%-7s p50=%5lld ns  p99=%6lld ns  p99.9=%7lld ns  max=%8lld ns  total=%6.2f ms\n", name,
+           samples[count / 2], samples[(int)(count * 0.99)], samples[(int)(count * 0.999)],
+           samples[count - 1], total / 1e6);
+}
+
+/* Times NUM_ALLOCATIONS allocations, each including the first write to the block as a request would do */
+static void run(void** pointers, long long* latency) {
+    unsigned int seed = 11;
+    struct timespec start, end;
+
+    for (int i = 0; i < NUM_ALLOCATIONS; ++i) {
+        size_t size = (rand_r(&seed) % 4 != 0) ? (size_t)(rand_r(&seed) % MAX_SMALL_SIZE) + 1
+                                                : (size_t)(rand_r(&seed) % MAX_LARGE_SIZE) + 1;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pointers[i] = HmmAlloc(size);
+        memset(pointers[i], 0, size);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        latency[i] = elapsedNs(&start, &end);
+    }
+}
+
+int main() {
+    static void* pointers[NUM_ALLOCATIONS];
+    static long long coldNs[NUM_ALLOCATIONS], warmNs[NUM_ALLOCATIONS];
+    const char* prefault = getenv("HMM_PREFAULT_MB");
+    const char* classes = getenv("HMM_PREWARM_CLASSES");
+
+    printf("Cold-start benchmark (HMM_PREFAULT_MB=%s, HMM_PREWARM_CLASSES=%s)\n",
+           prefault ? prefault : "unset", classes ? classes : "unset");
+
+    run(pointers, coldNs);  // The first allocations this process makes
+    for (int i = 0; i < NUM_ALLOCATIONS; ++i) {
+        HmmFree(pointers[i]);
+    }
+    run(pointers, warmNs);  // The same requests against a heap that has seen them
+
+    report("first", coldNs, NUM_ALLOCATIONS);
+    report("steady", warmNs, NUM_ALLOCATIONS);
+    return 0;
+}
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "heap.h"
+
+/* Define benchmark parameters */
+#define NUM_ALLOCS 20000 /* Live allocations per workload */
+
+typedef struct Workload {
+    const char* name;
+    size_t minSize;
+    size_t maxSize;
+} Workload;
+
+/* The fixed sizes of the other benchmarks, plus mixed small and medium requests */
+static const Workload workloads[] = {
+    {"16 B", 16, 16},
+    {"24 B", 24, 24},
+    {"72 B", 72, 72},
+    {"200 B", 200, 200},
+    {"1-256 B", 1, 256},
+    {"1-4096 B", 1, 4096},
+};
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+/* Bytes of the heap that are neither on the free list nor in a quick bin */
+static size_t liveBytes(void) {
+    hmmStats stats;
+    HmmGetStats(&stats);
+    return stats.heapBytes - stats.freeBytes - stats.quickBinBytes;
+}
+
+int main() {
+    static void* pointers[NUM_ALLOCS];
+    unsigned int seed = 1;
+
+    printf("%-10s %12s %14s %12s\n", "workload", "avg request", "bytes/alloc", "overhead");
+    for (size_t w = 0; w < NUM_WORKLOADS; ++w) {
+        const Workload* load = &workloads[w];
+        size_t requested = 0;
+        size_t before = liveBytes();
+
+        for (int i = 0; i < NUM_ALLOCS; ++i) {
+            size_t size = load->minSize + (size_t)rand_r(&seed) % (load->maxSize - load->minSize + 1);
+            pointers[i] = HmmAlloc(size);
+            requested += size;
+        }
+
+        double perAlloc = (double)(liveBytes() - before) / NUM_ALLOCS;
+        double avgRequest = (double)requested / NUM_ALLOCS;
+        printf("%-10s %12.1f %14.1f %12.1f\n", load->name, avgRequest, perAlloc, perAlloc - avgRequest);
+
+        for (int i = 0; i < NUM_ALLOCS; ++i) {
+            HmmFree(pointers[i]);
+        }
+    }
+    return 0;
+}
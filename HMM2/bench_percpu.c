@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "heap.h"
+
+/* Define benchmark parameters */
+#define OPS_PER_THREAD 200000 /* Allocation or deallocation operations per thread */
+#define WORKING_SET 64 /* Live blocks per thread */
+#define THREADS_PER_CPU 16 /* Scale up to this many threads per online CPU */
+#define MIN_MAX_THREADS 64 /* ...but always well past the core count */
+
+void* worker(void* arg) {
+    unsigned int seed = (unsigned int)(uintptr_t)arg;
+    void* pointers[WORKING_SET] = {NULL};
+
+    for (int i = 0; i < OPS_PER_THREAD; ++i) {
+        int index = rand_r(&seed) % WORKING_SET;
+        if (pointers[index] == NULL) {
+            pointers[index] = HmmAlloc((size_t)(rand_r(&seed) % HMM_DEFAULT_SMALL_MAX) + 1);
+        } else {
+            HmmFree(pointers[index]);
+            pointers[index] = NULL;
+        }
+    }
+
+    for (int i = 0; i < WORKING_SET; ++i) {
+        HmmFree(pointers[i]);
+    }
+    return NULL;
+}
+
+double run(int numThreads) {
+    pthread_t* threads = HmmAlloc(sizeof(pthread_t) * numThreads);
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < numThreads; ++i) {
+        pthread_create(&threads[i], NULL, worker, (void*)(uintptr_t)(i + 1));
+    }
+    for (int i = 0; i < numThreads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    HmmFree(threads);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return (double)numThreads * OPS_PER_THREAD / seconds / 1e6;
+}
+
+int main() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const char* mode = getenv("HMM_PERCPU");
+
+    printf("Per-CPU cache scaling benchmark (%ld CPUs, per-CPU caches %s)\n",
+           cpus, (mode && mode[0] == '0') ? "off" : "on");
+    long maxThreads = cpus * THREADS_PER_CPU;
+    if (maxThreads < MIN_MAX_THREADS) {
+        maxThreads = MIN_MAX_THREADS;
+    }
+
+    printf("%8s %12s\n", "threads", "Mops/s");
+    for (long threads = 1; threads <= maxThreads; threads *= 2) {
+        printf("%8ld %12.2f\n", threads, run((int)threads));
+    }
+    return 0;
+}
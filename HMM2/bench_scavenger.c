@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "heap.h"
+
+/* Define benchmark parameters */
+#define NUM_SLOTS 4096 /* Live blocks kept by the foreground thread */
+#define MAX_SIZE 4096 /* Mostly above HMM_SMALL_MAX, so frees reach the free list */
+#define MAX_ITERATIONS 400000 /* Number of allocation and deallocation operations */
+
+static long long elapsedNs(struct timespec* start, struct timespec* end) {
+    return (end->tv_sec - start->tv_sec) * 1000000000LL + (end->tv_nsec - start->tv_nsec);
+}
+
+static int compareLatency(const void* a, const void* b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char* name, long long* samples, int count) {
+    qsort(samples, count, sizeof(long long), compareLatency);
+    printf("%-6s n=%-7d p50=%6lld ns  p99=%6lld ns  p99.9=%7lld ns\n", name, count,
+           samples[count / 2], samples[(int)(count * 0.99)], samples[(int)(count * 0.999)]);
+}
+
+int main() {
+    static void* pointers[NUM_SLOTS];
+    static long long allocNs[MAX_ITERATIONS], freeNs[MAX_ITERATIONS];
+    int allocCount = 0, freeCount = 0;
+    unsigned int seed = 42;
+    struct timespec start, end;
+    const char* mode = getenv("HMM_SCAVENGER");
+
+    printf("Foreground latency benchmark (scavenger %s)\n", (mode && strcmp(mode, "1") == 0) ? "on" : "off");
+
+    for (int i = 0; i < MAX_ITERATIONS; ++i) {
+        int index = rand_r(&seed) % NUM_SLOTS;
+        if (pointers[index] == NULL) {
+            size_t size = (size_t)(rand_r(&seed) % MAX_SIZE) + 1;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            pointers[index] = HmmAlloc(size);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            allocNs[allocCount++] = elapsedNs(&start, &end);
+        } else {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            HmmFree(pointers[index]);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            freeNs[freeCount++] = elapsedNs(&start, &end);
+            pointers[index] = NULL;
+        }
+    }
+
+    report("free", freeNs, freeCount);
+    report("alloc", allocNs, allocCount);
+    return 0;
+}
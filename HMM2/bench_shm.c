@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "heap.h"
+
+/* Define benchmark parameters */
+#define SHM_HEAP_SIZE (64UL * 1024 * 1024) /* Shared heap backing the messages */
+#define TOTAL_BYTES (512UL * 1024 * 1024) /* Bytes sent per message size and mode */
+
+static const size_t messageSizes[] = {256, 4096, 65536, 1048576};
+#define NUM_MESSAGE_SIZES (sizeof(messageSizes) / sizeof(messageSizes[0]))
+
+/* Both modes fill every message in the producer and read every byte in the consumer */
+static void fillMessage(unsigned char* msg, size_t size, size_t seq) {
+    memset(msg, (int)(seq & 0xff), size);
+}
+
+static unsigned long checksum(const unsigned char* msg, size_t size) {
+    unsigned long sum = 0;
+    for (size_t i = 0; i < size; i += sizeof(unsigned long)) {
+        unsigned long word;
+        memcpy(&word, msg + i, sizeof(word));
+        sum += word;
+    }
+    return sum;
+}
+
+static int readFull(int fd, void* buf, size_t size) {
+    for (size_t done = 0; done < size; ) {
+        ssize_t n = read(fd, (char*)buf + done, size - done);
+        if (n <= 0) {
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+static int writeFull(int fd, const void* buf, size_t size) {
+    for (size_t done = 0; done < size; ) {
+        ssize_t n = write(fd, (const char*)buf + done, size - done);
+        if (n <= 0) {
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+/* Messages are copied into the pipe by the producer and out of it by the consumer */
+static double runPipe(size_t size, size_t count) {
+    int fds[2];
+    struct timespec start, end;
+
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid == 0) {
+        unsigned char* msg = HmmAlloc(size);
+        unsigned long sum = 0;
+        close(fds[1]);
+        for (size_t i = 0; i < count; ++i) {
+            if (readFull(fds[0], msg, size) != 0) {
+                _exit(1);
+            }
+            sum += checksum(msg, size);
+        }
+        _exit(sum == 0 && count > 1);
+    }
+
+    unsigned char* msg = HmmAlloc(size);
+    close(fds[0]);
+    for (size_t i = 0; i < count; ++i) {
+        fillMessage(msg, size, i);
+        if (writeFull(fds[1], msg, size) != 0) {
+            perror("write");
+            exit(1);
+        }
+    }
+    close(fds[1]);
+    HmmFree(msg);
+
+    int status;
+    waitpid(pid, &status, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/* Messages are written in place in the shared heap; only their offsets cross the pipe */
+static double runShm(hmmShm* shm, size_t size, size_t count) {
+    int fds[2];
+    struct timespec start, end;
+
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid == 0) {
+        unsigned long sum = 0;
+        close(fds[1]);
+        for (size_t i = 0; i < count; ++i) {
+            size_t offset;
+            if (readFull(fds[0], &offset, sizeof(offset)) != 0) {
+                _exit(1);
+            }
+            sum += checksum(HmmShmToPtr(shm, offset), size);
+            HmmShmFree(shm, offset);
+        }
+        _exit(sum == 0 && count > 1);
+    }
+
+    close(fds[0]);
+    for (size_t i = 0; i < count; ++i) {
+        size_t offset;
+        while ((offset = HmmShmAlloc(shm, size)) == 0) {
+            sched_yield();  // Heap full: wait for the consumer to free messages
+        }
+        fillMessage(HmmShmToPtr(shm, offset), size, i);
+        if (writeFull(fds[1], &offset, sizeof(offset)) != 0) {
+            perror("write");
+            exit(1);
+        }
+    }
+    close(fds[1]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main() {
+    hmmShm* shm = HmmShmCreate(NULL, SHM_HEAP_SIZE);
+    if (shm == NULL) {
+        perror("HmmShmCreate");
+        return 1;
+    }
+
+    printf("Producer -> consumer throughput, %lu MB per run\n", TOTAL_BYTES >> 20);
+    printf("%10s %16s %16s %10s\n", "message", "pipe copy MB/s", "shm offset MB/s", "speedup");
+    for (size_t i = 0; i < NUM_MESSAGE_SIZES; ++i) {
+        size_t size = messageSizes[i];
+        size_t count = TOTAL_BYTES / size;
+        double pipeSeconds = runPipe(size, count);
+        double shmSeconds = runShm(shm, size, count);
+        double mb = (double)(TOTAL_BYTES >> 20);
+
+        printf("%10zu %16.0f %16.0f %9.2fx\n", size, mb / pipeSeconds, mb / shmSeconds,
+               pipeSeconds / shmSeconds);
+    }
+
+    HmmShmClose(shm);
+    return 0;
+}
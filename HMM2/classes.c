@@ -0,0 +1,255 @@
+/* classes.c (Profile-driven size-class tuning) */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "heap.h"
+
+/*
+ * With HMM_CLASS_PROFILE_OUT=<file>, HmmAlloc samples request sizes into a
+ * histogram (see classSample() in heap.c) and at exit the histogram is turned
+ * into the class table that wastes the fewest bytes on it. The default table
+ * stops at HMM_DEFAULT_SMALL_MAX; a tuned one may reach HMM_SMALL_MAX when
+ * that moves requests off the free list and into the caches without rounding
+ * them up further. The next start loads it with
+ * HMM_CLASS_PROFILE=<file>. The table is only ever replaced at startup: blocks
+ * already sitting in the caches and quick bins were filed under the old
+ * classes and could be too small for the new ones.
+ */
+
+#define PROFILE_MAX_BYTES 4096  // Room for a table plus comments
+
+static const char* profileOut = NULL;
+
+/* Block granules a request of `size` bytes needs */
+static size_t requestGranules(size_t size) {
+    size_t granules = (size + META_DATA_SIZE + HMM_CLASS_GRANULE - 1) / HMM_CLASS_GRANULE;
+    return granules < HMM_MIN_BLOCK / HMM_CLASS_GRANULE ? HMM_MIN_BLOCK / HMM_CLASS_GRANULE : granules;
+}
+
+/*
+ * Loads the table named by HMM_CLASS_PROFILE. Called from heap initialization
+ * with the heap lock held, so it reads the file with plain system calls and
+ * never allocates. A missing or malformed profile keeps the default table.
+ */
+void classTableLoad(void) {
+    const char* path = getenv("HMM_CLASS_PROFILE");
+    char text[PROFILE_MAX_BYTES + 1];
+    size_t sizes[HMM_SIZE_CLASSES];
+    size_t length = 0;
+    int count = 0;
+
+    if (path == NULL || *path == '\0') {
+        return;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    for (ssize_t n; length < PROFILE_MAX_BYTES && (n = read(fd, text + length, PROFILE_MAX_BYTES - length)) > 0; ) {
+        length += (size_t)n;
+    }
+    close(fd);
+    text[length] = '\0';
+
+    for (char* line = text; line && *line; ) {
+        char* next = strchr(line, '\n');
+        if (next) {
+            *next++ = '\0';
+        }
+        if (*line != '#') {
+            char* end;
+            for (unsigned long size = strtoul(line, &end, 10); end != line; size = strtoul(line, &end, 10)) {
+                if (count == HMM_SIZE_CLASSES) {
+                    return;  // Too many classes
+                }
+                sizes[count++] = size;
+                line = end;
+            }
+        }
+        line = next;
+    }
+
+    if (count > 0) {
+        classTableSet(sizes, count);
+    }
+}
+
+/* Writes the table tuned on this run's histogram to HMM_CLASS_PROFILE_OUT */
+static void classProfileSave(void) {
+    size_t counts[HMM_CLASS_BUCKETS];
+    size_t sizes[HMM_SIZE_CLASSES];
+
+    classHistogram(counts);
+    int classes = classTune(counts, sizes);
+    classProfileWrite(profileOut, sizes, classes, counts);
+}
+
+/* Reads HMM_CLASS_PROFILE_OUT and starts sampling if it is set. Called once from heap initialization. */
+void classProfileInit(void) {
+    profileOut = getenv("HMM_CLASS_PROFILE_OUT");
+    if (profileOut == NULL || *profileOut == '\0') {
+        return;
+    }
+
+    classSampleStart();
+    atexit(classProfileSave);
+}
+
+/* Granules handed out, to the sampled requests and to the pseudo-requests that spread the spare classes */
+typedef struct tuneCost {
+    double sampled;
+    double spread;
+} tuneCost;
+
+static int costLess(tuneCost a, tuneCost b) {
+    return a.sampled < b.sampled || (a.sampled == b.sampled && a.spread < b.spread);
+}
+
+/* Sampled small requests a class table of `count` classes leaves to the free list */
+static size_t classUncached(const size_t* counts, const size_t* sizes, int count) {
+    size_t uncached = 0;
+
+    for (size_t size = sizes[count - 1] + 1; size <= HMM_SMALL_MAX; ++size) {
+        uncached += counts[size];
+    }
+    return uncached;
+}
+
+/*
+ * Derives the class table that minimizes internal fragmentation on a histogram
+ * from classHistogram() and returns its number of classes. Dynamic programming
+ * over the class boundaries: best[k][g] is the least waste of k classes whose
+ * largest block has g granules and that cover every request needing up to g
+ * granules. Requests above the largest class cost what the free list gives
+ * them, their granules rounded up to 16 bytes, so the end of the table is
+ * chosen too. Among tables that waste the same, the one leaving the fewest
+ * sampled requests to the free list wins, then the one that spreads the spare
+ * classes best over the range (a pseudo-count of one request per granule).
+ * If the result does not beat the table in use by the same measure, the table
+ * in use is returned instead, so tuning never raises fragmentation.
+ */
+int classTune(const size_t* counts, size_t* sizes) {
+    enum { MIN_GRANULES = HMM_MIN_BLOCK / HMM_CLASS_GRANULE, MAX_GRANULES = HMM_CLASS_GRANULES - 1 };
+    double sampled[HMM_CLASS_GRANULES + 1] = {0};  // Sampled requests by granules needed, then prefix sums
+    double spread[HMM_CLASS_GRANULES + 1] = {0};   // Pseudo-requests, likewise
+    tuneCost beyond[HMM_CLASS_GRANULES + 1] = {{0, 0}};  // Cost on the free list of the requests above g granules
+    tuneCost best[HMM_SIZE_CLASSES + 1][HMM_CLASS_GRANULES];
+    int from[HMM_SIZE_CLASSES + 1][HMM_CLASS_GRANULES];
+    size_t current[HMM_SIZE_CLASSES];
+
+    for (size_t granules = MIN_GRANULES; granules <= MAX_GRANULES; ++granules) {
+        spread[granules] = 1.0;
+    }
+    for (size_t size = 0; size <= HMM_SMALL_MAX; ++size) {
+        sampled[requestGranules(size)] += (double)counts[size];
+    }
+    for (int g = MAX_GRANULES - 1; g >= MIN_GRANULES - 1; --g) {
+        beyond[g].sampled = beyond[g + 1].sampled + sampled[g + 1] * (g + 1);
+        beyond[g].spread = beyond[g + 1].spread + spread[g + 1] * (g + 1);
+    }
+    for (size_t granules = MIN_GRANULES; granules <= MAX_GRANULES; ++granules) {
+        sampled[granules] += sampled[granules - 1];
+        spread[granules] += spread[granules - 1];
+    }
+
+    // Rounding a request up to a block of j granules costs j per request: the bytes it needs are the same under any table
+    for (int j = MIN_GRANULES; j <= MAX_GRANULES; ++j) {
+        best[1][j] = (tuneCost){sampled[j] * j, spread[j] * j};
+        from[1][j] = 0;
+    }
+    for (int k = 2; k <= HMM_SIZE_CLASSES; ++k) {
+        for (int j = MIN_GRANULES + k - 1; j <= MAX_GRANULES; ++j) {
+            from[k][j] = -1;
+            for (int i = MIN_GRANULES + k - 2; i < j; ++i) {
+                tuneCost cost = {best[k - 1][i].sampled + (sampled[j] - sampled[i]) * j,
+                                 best[k - 1][i].spread + (spread[j] - spread[i]) * j};
+                if (from[k][j] < 0 || costLess(cost, best[k][j])) {
+                    best[k][j] = cost;
+                    from[k][j] = i;
+                }
+            }
+        }
+    }
+
+    // Pick the end of the table; below HMM_SIZE_CLASSES granules a class per granule wastes nothing
+    int top = MIN_GRANULES, classes = 1;
+    double topUncached = 0;
+    tuneCost topCost = {-1, 0};
+    for (int j = MIN_GRANULES; j <= MAX_GRANULES; ++j) {
+        int k = (j - MIN_GRANULES + 1 < HMM_SIZE_CLASSES) ? j - MIN_GRANULES + 1 : HMM_SIZE_CLASSES;
+        tuneCost cost = {best[k][j].sampled + beyond[j].sampled, best[k][j].spread + beyond[j].spread};
+        double uncached = sampled[MAX_GRANULES] - sampled[j];
+        if (topCost.sampled < 0 || cost.sampled < topCost.sampled ||
+            (cost.sampled == topCost.sampled && (uncached < topUncached ||
+                                                 (uncached == topUncached && costLess(cost, topCost))))) {
+            top = j;
+            classes = k;
+            topCost = cost;
+            topUncached = uncached;
+        }
+    }
+    for (int k = classes, j = top; k > 0; j = from[k][j], --k) {
+        sizes[k - 1] = (size_t)j * HMM_CLASS_GRANULE - META_DATA_SIZE;
+    }
+
+    // Keep the table in use unless the new one wastes less, or as little while caching more
+    int currentCount = classTableGet(current);
+    double waste = classWaste(counts, sizes, classes), currentWaste = classWaste(counts, current, currentCount);
+    if (waste > currentWaste ||
+        (waste == currentWaste && classUncached(counts, sizes, classes) >= classUncached(counts, current, currentCount))) {
+        memcpy(sizes, current, currentCount * sizeof(size_t));
+        return currentCount;
+    }
+    return classes;
+}
+
+/*
+ * Bytes a class table of `count` classes hands out beyond the requested sizes
+ * for a histogram, small requests only. Requests above its largest class are
+ * charged the alignment padding the free list gives them.
+ */
+double classWaste(const size_t* counts, const size_t* sizes, int count) {
+    double waste = 0;
+    int cls = 0;
+
+    for (size_t size = 0; size <= HMM_SMALL_MAX; ++size) {
+        while (cls < count && sizes[cls] < size) {
+            cls++;
+        }
+        size_t usable = (cls < count) ? sizes[cls] : requestGranules(size) * HMM_CLASS_GRANULE - META_DATA_SIZE;
+        waste += (double)counts[size] * (double)(usable - size);
+    }
+    return waste;
+}
+
+/* Writes a class table in the format HMM_CLASS_PROFILE reads. Returns -1 on failure. */
+int classProfileWrite(const char* path, const size_t* sizes, int count, const size_t* counts) {
+    size_t current[HMM_SIZE_CLASSES];
+    int currentCount;
+    size_t samples = 0;
+
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        return -1;
+    }
+
+    currentCount = classTableGet(current);
+    for (size_t size = 0; size <= HMM_SMALL_MAX; ++size) {
+        samples += counts[size];
+    }
+
+    fprintf(file, "# HMM size-class profile: usable bytes of each class\n");
+    if (samples > 0) {
+        fprintf(file, "# %zu sampled small requests; waste per request %.1f B (table in use %.1f B)\n", samples,
+                classWaste(counts, sizes, count) / samples, classWaste(counts, current, currentCount) / samples);
+    }
+    for (int cls = 0; cls < count; ++cls) {
+        fprintf(file, "%zu%c", sizes[cls], (cls % 8 == 7 || cls == count - 1) ? '\n' : ' ');
+    }
+    return fclose(file) == 0 ? 0 : -1;
+}
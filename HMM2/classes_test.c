@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "heap.h"
+
+/* Define testing parameters */
+#define NUM_REQUESTS 200000 /* Requests drawn for each tuning histogram */
+
+static int failures = 0;
+
+static void check(int ok, const char* what) {
+    if (!ok) {
+        fprintf(stderr, "FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+/*
+ * Loads the profile at `path` in a child, so that every case starts from the
+ * default table and no cached block outlives the table it was filed under.
+ * Returns 1 if the child ended up with exactly `count` classes from `expected`.
+ */
+static int loads(const char* path, const size_t* expected, int count) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        size_t sizes[HMM_SIZE_CLASSES];
+        setenv("HMM_CLASS_PROFILE", path, 1);
+        classTableLoad();
+        int classes = classTableGet(sizes);
+        _exit(classes == count && memcmp(sizes, expected, count * sizeof(size_t)) == 0 ? 0 : 1);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* Writes a profile by hand, for tables classProfileWrite() would not produce */
+static void writeProfile(const char* path, const char* text) {
+    FILE* file = fopen(path, "w");
+    if (file) {
+        fputs(text, file);
+        fclose(file);
+    }
+}
+
+/* Valid tables come back from classProfileWrite() through classTableLoad() unchanged */
+static void testRoundTrip(const char* path) {
+    static size_t counts[HMM_CLASS_BUCKETS];
+    const size_t records[] = {24, 56, 88, 280, 328, 520, 664, 904};
+    size_t full[HMM_SIZE_CLASSES];
+
+    for (int cls = 0; cls < HMM_SIZE_CLASSES; ++cls) {
+        full[cls] = 24 + (size_t)cls * 2 * HMM_CLASS_GRANULE;  // Every other granule, then up to the largest size allowed
+    }
+    full[HMM_SIZE_CLASSES - 1] = HMM_SMALL_MAX;
+
+    counts[280] = counts[520] = 1;
+    check(classProfileWrite(path, records, 8, counts) == 0, "write a profile");
+    check(loads(path, records, 8), "round-trip an 8-class profile");
+    check(classProfileWrite(path, full, HMM_SIZE_CLASSES, counts) == 0, "write a full profile");
+    check(loads(path, full, HMM_SIZE_CLASSES), "round-trip a 24-class profile ending at HMM_SMALL_MAX");
+}
+
+/* Malformed profiles leave the default table in place */
+static void testRejected(const char* path) {
+    static const struct {
+        const char* text;
+        const char* what;
+    } cases[] = {
+        {"24 88 56\n", "reject an unsorted profile"},
+        {"24 50 88\n", "reject a size that does not fill whole granules"},
+        {"24 56 1032\n", "reject a size above HMM_SMALL_MAX"},
+        {"24 40 56 72 88 104 120 136 152 168 184 200\n216 232 248 264 280 296 312 328 344 360 376 392 408\n",
+         "reject more than HMM_SIZE_CLASSES sizes"},
+        {"# nothing but a comment\n", "ignore an empty profile"},
+    };
+    size_t defaults[HMM_SIZE_CLASSES];
+    int count = classTableGet(defaults);
+
+    check(count == HMM_DEFAULT_CLASSES && defaults[count - 1] == HMM_DEFAULT_SMALL_MAX, "start from the default table");
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        writeProfile(path, cases[i].text);
+        check(loads(path, defaults, count), cases[i].what);
+    }
+}
+
+/* The tuned table never wastes more than the table in use */
+static void testTuneNeverWorse(void) {
+    static size_t counts[HMM_CLASS_BUCKETS];
+    size_t current[HMM_SIZE_CLASSES], tuned[HMM_SIZE_CLASSES];
+    unsigned int seed = 7;
+
+    int count = classTableGet(current);
+    for (size_t maxSize = 16; maxSize <= HMM_SMALL_MAX; maxSize *= 2) {
+        memset(counts, 0, sizeof(counts));
+        for (int i = 0; i < NUM_REQUESTS; ++i) {
+            counts[(size_t)rand_r(&seed) % maxSize + 1]++;
+        }
+        int tunedCount = classTune(counts, tuned);
+        check(classWaste(counts, tuned, tunedCount) <= classWaste(counts, current, count),
+              "tune a table that wastes no more than the one in use");
+    }
+}
+
+int main() {
+    char path[] = "/tmp/hmm_classes_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    HmmFree(HmmAlloc(1));  // Initialize the heap with the default table
+    printf("Round-tripping class profiles...\n");
+    testRoundTrip(path);
+    printf("Loading malformed class profiles...\n");
+    testRejected(path);
+    printf("Tuning class tables...\n");
+    testTuneNeverWorse();
+
+    unlink(path);
+    printf("%s\n", failures ? "Test failed." : "Test complete.");
+    return failures ? 1 : 0;
+}
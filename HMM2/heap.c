@@ -2,24 +2,85 @@
 
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
 #include <limits.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include "heap.h"
 
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23  // Linux 5.14; older kernels fail it with EINVAL
+#endif
+
 /* Declaration of the static array representing the virtual heap */
 static size_t* heapBase = NULL; // Pointer to the base of the virtual heap
 static size_t* programBreak = NULL; // Pointer representing the current end of the heap
+static char* heapEnd = NULL; // End of the last block; may sit a few bytes below programBreak
 
-/* Global variables for free list */
-fnode *Head = NULL;
-fnode *Tail = NULL;
+/* The main heap's free list; offsets are relative to the address sbrk first returned */
+static hmmList mainList;
+static hmmArena mainArena = { NULL, &mainList };
 
 int isHeapFull = 0;
 int isFlistAvailable = 0;
 
+/* Protects the free list; the per-CPU caches in front of it need no lock */
+static pthread_mutex_t heapLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Held by heapScavenge() while runs are off the free list for madvise; taken before heapLock */
+static pthread_mutex_t releaseLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A free run the scavenger has seen, see heapScavenge() */
+typedef struct releaseRun {
+    size_t offset;
+    size_t length;
+    int age;  // Consecutive passes it was found unchanged
+} releaseRun;
+
+/* Frees waiting for the scavenger thread, linked through fnode->next, and the bytes they hold */
+static size_t deferredFrees = 0;
+static size_t deferredBytes = 0;
+
+/* Quick bins: freed small blocks parked uncoalesced per size class, LIFO through fnode->next */
+static size_t quickBins[HMM_SIZE_CLASSES];
+static int quickBinsEnabled = 1;
+
+/* Counters reported by HmmGetStats(), updated under heapLock */
+static size_t heapBytes = 0;
+static size_t quickHits = 0;
+static size_t quickMisses = 0;
+static size_t consolidations = 0;
+
+/* Size classes: usable bytes per class and lookups by block granules, filled from the default table or a profile */
+#define DEFAULT_CLASS_SIZES \
+    24, 40, 56, 72, 88, 104, 120, 136, 152, 168, 184, 200, 216, 232, 248, HMM_DEFAULT_SMALL_MAX
+static const size_t defaultClassSizes[HMM_DEFAULT_CLASSES] = { DEFAULT_CLASS_SIZES };
+static size_t classSizes[HMM_SIZE_CLASSES] = { DEFAULT_CLASS_SIZES };
+static int classCount = HMM_DEFAULT_CLASSES;
+static size_t classMax = HMM_DEFAULT_SMALL_MAX;  // Usable bytes of the largest class
+static signed char classAbove[HMM_CLASS_GRANULES];  // Smallest class whose block has at least this many granules, or -1
+static signed char classBelow[HMM_CLASS_GRANULES];  // Largest class whose block has at most this many granules, or -1
+
+/* Sampled request sizes, see classSample() */
+static int classSampling = 0;
+static size_t classCounts[HMM_CLASS_BUCKETS];
+static __thread int sampleCountdown __attribute__((tls_model("initial-exec")));
+static __thread uint64_t sampleSeed __attribute__((tls_model("initial-exec")));
+
+static void heapInit(void);
+static void classSample(size_t size);
+static void *heapAlloc(size_t blockSize);
+static void heapFree(fnode *blockToFree);
+static int drainDeferred(void);
+static int deferredOverLimit(void);
+static void linkBefore(hmmArena* arena, fnode *blockToFree, size_t curr);
+static int parkQuick(fnode *block);
+static int consolidateQuickBins(void);
+
 /* Adjusts the simulated program break */
 void *sbreak(size_t increment) {
     void* oldProgBreak = sbrk(0);   // Get current program break
@@ -29,153 +90,358 @@ void *sbreak(size_t increment) {
     return oldProgBreak;  // Return old end of heap
 }
 
+/* Maps a request size to its small size class, or -1 if it is too large to be cached */
+int sizeClass(size_t size) {
+    if (size > classMax) {
+        return -1;
+    }
+    return classAbove[(size + META_DATA_SIZE + HMM_CLASS_GRANULE - 1) / HMM_CLASS_GRANULE];
+}
+
+/* Returns the number of usable bytes handed out for a size class */
+size_t classSize(int sizeClass) {
+    return classSizes[sizeClass];
+}
+
+/* Largest size class a block with the given usable bytes can serve, or -1 */
+int blockClass(size_t usable) {
+    if (usable < classSizes[0] || usable > classMax) {
+        return -1;
+    }
+    return classBelow[(usable + META_DATA_SIZE) / HMM_CLASS_GRANULE];
+}
+
+/*
+ * Installs a class table: `count` ascending usable sizes, at most
+ * HMM_SIZE_CLASSES, each filling whole granules with its header and none above
+ * HMM_SMALL_MAX. Requests above the largest class go to the free list. Only
+ * valid before the first small block is freed, since cached blocks keep the
+ * class they were filed under. Returns -1 and keeps the current table if
+ * `sizes` is not a valid table.
+ */
+int classTableSet(const size_t* sizes, int count) {
+    if (count < 1 || count > HMM_SIZE_CLASSES || sizes[count - 1] > HMM_SMALL_MAX) {
+        return -1;
+    }
+    for (int cls = 0; cls < count; ++cls) {
+        size_t block = sizes[cls] + META_DATA_SIZE;
+        if (block < HMM_MIN_BLOCK || block % HMM_CLASS_GRANULE != 0 || (cls > 0 && sizes[cls] <= sizes[cls - 1])) {
+            return -1;
+        }
+    }
+
+    int above = 0, below = -1;
+    for (size_t granules = 0; granules < HMM_CLASS_GRANULES; ++granules) {
+        size_t block = granules * HMM_CLASS_GRANULE;
+        while (above < count && sizes[above] + META_DATA_SIZE < block) {
+            above++;
+        }
+        while (below + 1 < count && sizes[below + 1] + META_DATA_SIZE <= block) {
+            below++;
+        }
+        classAbove[granules] = (signed char)(above < count ? above : -1);
+        classBelow[granules] = (signed char)below;
+    }
+    memcpy(classSizes, sizes, count * sizeof(size_t));
+    classCount = count;
+    classMax = sizes[count - 1];
+    return 0;
+}
+
+/* Copies the class table in use and returns its number of classes */
+int classTableGet(size_t* sizes) {
+    memcpy(sizes, classSizes, classCount * sizeof(size_t));
+    return classCount;
+}
+
+/* Starts sampling request sizes into the class histogram */
+void classSampleStart(void) {
+    __atomic_store_n(&classSampling, 1, __ATOMIC_RELAXED);
+}
+
+/* Copies the sampled histogram: HMM_CLASS_BUCKETS counts, one per request size up to HMM_SMALL_MAX, then one for all larger requests */
+void classHistogram(size_t* counts) {
+    for (size_t size = 0; size < HMM_CLASS_BUCKETS; ++size) {
+        counts[size] = __atomic_load_n(&classCounts[size], __ATOMIC_RELAXED);
+    }
+}
+
+/* Records roughly one request in HMM_CLASS_SAMPLE_PERIOD, at randomized intervals so periodic request patterns do not alias */
+static void classSample(size_t size) {
+    if (--sampleCountdown > 0) {
+        return;
+    }
+
+    if (sampleSeed == 0) {
+        sampleSeed = (uintptr_t)&sampleSeed;  // Differs per thread
+    }
+    sampleSeed = sampleSeed * 6364136223846793005ULL + 1442695040888963407ULL;
+    sampleCountdown = 1 + (int)((sampleSeed >> 33) % (2 * HMM_CLASS_SAMPLE_PERIOD - 1));
+    __atomic_fetch_add(&classCounts[size > HMM_SMALL_MAX ? HMM_SMALL_MAX + 1 : size], 1, __ATOMIC_RELAXED);
+}
+
 void *HmmAlloc(size_t blockSize) {
-    if (Head == NULL) {
-        freeListInit();  // Initialize the free list if it is empty
+    if (!__atomic_load_n(&isFlistAvailable, __ATOMIC_ACQUIRE)) {
+        heapInit();  // Initialize the free list on first use
     }
 
     if (isHeapFull) {
         return NULL;
     }
 
-    // Align block size to be a multiple of 8
-    blockSize = (blockSize + 7) & ~7;  // Align the block size to 8 bytes
-    size_t totalSizeNeeded = blockSize + META_DATA_SIZE;   // Calculate total size needed including node overhead
-    fnode* allocBlock = (fnode*)firstFit(totalSizeNeeded);  // Find a suitable block using first-fit strategy
+    if (__builtin_expect(classSampling, 0)) {
+        classSample(blockSize);
+    }
 
-    if (allocBlock == NULL) {
-        size_t pagesNeeded = (totalSizeNeeded + PAGE - 1) / PAGE;  // Calculate pages needed for allocation
-        if (sbreak(pagesNeeded * PAGE) == (void*)-1) {  // Attempt to expand the heap
-            isHeapFull = 1;
-            return NULL; // Allocation failed
+    int cls = sizeClass(blockSize);
+    if (cls >= 0) {
+        void* cached = percpuCacheAlloc(cls);  // Lock-free hit on this CPU's cache
+        if (cached) {
+            return cached;
         }
-        int failed = insertend(pagesNeeded);  // Insert the new block into the free list
-        if (failed == -1) return NULL;
-        allocBlock = (fnode*)firstFit(totalSizeNeeded);
-        if (allocBlock == NULL) return NULL;  // Handle failure if no block was found
-    }
-    
-    // Remove block from free list
-    if (allocBlock == Head) {
-        Head = Head->next;  // Update head if the allocated block was the head
-        if (Head) {
-            Head->prev = NULL;  // Update previous pointer of the new head
-        }
-    } else if (allocBlock == Tail) {
-        Tail = Tail->prev;  // Update tail if the allocated block was the tail
-        if (Tail) {
-            Tail->next = NULL;  // Update next pointer of the new tail
-        }
-    } else {
-        if (allocBlock->prev) {
-            allocBlock->prev->next = allocBlock->next;  // Update previous node's next pointer
+        blockSize = classSize(cls);  // Round up so the block can be recycled for the whole class
+    }
+
+    scavengerPoll();  // (Re)start the scavenger thread if it is wanted but not running
+
+    pthread_mutex_lock(&heapLock);
+    void* ptr = heapAlloc(blockSize);
+    pthread_mutex_unlock(&heapLock);
+    return ptr;
+}
+
+/* Carves a block out of the free list, growing the heap if needed. Caller holds heapLock. */
+static void *heapAlloc(size_t blockSize) {
+    if (blockSize > SIZE_MAX - HMM_ALIGN - PAGE) {
+        return NULL;
+    }
+
+    // Small requests arrive rounded to their class size: try the matching quick bin first
+    int cls = sizeClass(blockSize);
+    if (cls >= 0 && quickBinsEnabled) {
+        fnode* parked = NODE_AT(&mainArena, quickBins[cls]);
+        if (parked) {
+            quickBins[cls] = parked->next;
+            quickHits++;
+            return (char*)parked + META_DATA_SIZE;
         }
-        if (allocBlock->next) {
-            allocBlock->next->prev = allocBlock->prev;  // Update next node's previous pointer
+        quickMisses++;
+    }
+
+    void* ptr = arenaAlloc(&mainArena, blockSize);  // Find a suitable block using first-fit strategy
+
+    // While the scavenger runs the deferred frees are its work and growing the heap keeps this path short,
+    // unless they pile up faster than it drains them. Without it (e.g. in a forked child) nobody else will.
+    if (ptr == NULL && (!scavengerActive() || deferredOverLimit()) && drainDeferred()) {
+        ptr = arenaAlloc(&mainArena, blockSize);  // Deferred frees may have made room
+    }
+
+    if (ptr == NULL && consolidateQuickBins()) {
+        ptr = arenaAlloc(&mainArena, blockSize);  // So may the blocks parked in the quick bins
+    }
+
+    if (ptr == NULL) {
+        size_t pagesNeeded = (blockSize + HMM_MIN_BLOCK + PAGE - 1) / PAGE;  // Calculate pages needed for allocation
+        if (insertend(pagesNeeded) == -1) {  // Expand the heap and append the new space to the free list
+            return NULL; // Allocation failed
         }
+        ptr = arenaAlloc(&mainArena, blockSize);
     }
+    return ptr;
+}
 
-    allocBlock->next = NULL;  // Set next pointer of allocated block to NULL
-    allocBlock->prev = NULL;  // Set previous pointer of allocated block to NULL
+/* Takes a block from an arena's free list without growing it. Returns NULL if nothing fits. */
+void *arenaAlloc(hmmArena *arena, size_t blockSize) {
+    if (blockSize > SIZE_MAX - HMM_ALIGN) {
+        return NULL;
+    }
+
+    // Align the block, header included, to 16 bytes; once freed it must still hold the free-list links
+    size_t totalSizeNeeded = (blockSize + META_DATA_SIZE + HMM_FLAGS_MASK) & ~HMM_FLAGS_MASK;
+    if (totalSizeNeeded < HMM_MIN_BLOCK) {
+        totalSizeNeeded = HMM_MIN_BLOCK;
+    }
+
+    fnode* allocBlock = (fnode*)firstFit(arena, totalSizeNeeded);
+    if (allocBlock == NULL) {
+        return NULL;
+    }
+
+    removeNode(arena, allocBlock);  // Remove block from free list
+    allocBlock->length |= HMM_INUSE;  // Only now: a crash before this leaves the block free, not lost
 
     allocBlock = (fnode*)((char*)allocBlock + META_DATA_SIZE);  // Adjust the pointer to point to the start of the usable memory
     return (void*)allocBlock;  // Return the pointer to the allocated memory
 }
 
+/* Returns a block to an arena's free list and coalesces */
+void arenaFree(hmmArena *arena, void *ptr) {
+    insertFree(arena, (fnode*)((char*)ptr - META_DATA_SIZE));
+    mergeNodes(arena);
+}
+
+static void heapForkPrepare(void) {
+    pthread_mutex_lock(&releaseLock);  // Wait until the runs being released are back on the free list
+    pthread_mutex_lock(&heapLock);
+}
+
+static void heapForkRelease(void) {
+    pthread_mutex_unlock(&heapLock);
+    pthread_mutex_unlock(&releaseLock);
+}
+
+/* One-time setup of the free list and the per-CPU caches */
+static void heapInit(void) {
+    int initialized = 0;
+
+    pthread_mutex_lock(&heapLock);
+    if (!isFlistAvailable) {
+        const char* env = getenv("HMM_QUICKBINS");
+        quickBinsEnabled = !(env && strcmp(env, "0") == 0);
+        classTableSet(defaultClassSizes, HMM_DEFAULT_CLASSES);
+        classTableLoad();  // HMM_CLASS_PROFILE, read without allocating
+        freeListInit();
+        initialized = 1;
+    }
+    pthread_mutex_unlock(&heapLock);
+
+    // Outside the lock: both of these may call back into malloc
+    if (initialized) {
+        pthread_atfork(heapForkPrepare, heapForkRelease, heapForkRelease);  // Never fork with the free list locked
+        percpuInit();
+        scavengerInit();
+        classProfileInit();
+    }
+}
+
 /* Initializes the free list */
 void freeListInit(void) {
     // Initialize the heap and the free list
     size_t initialHeapSize = 2 * PAGE;
     if (heapBase == NULL) {
-        heapBase = (size_t*)sbreak(initialHeapSize);
-        if (heapBase == (void*)-1) {
+        char* base = (char*)sbreak(initialHeapSize);
+        if (base == (void*)-1) {
             isHeapFull = -1;
             return;
         }
-        programBreak = heapBase;
+        programBreak = (size_t*)(base + initialHeapSize);
+        heapBytes += initialHeapSize;
+        mainArena.base = base;
+        // Start the first block above the arena base (offset 0 means "none") and just below
+        // a 16-byte boundary so that its payload is aligned
+        heapBase = (size_t*)((((uintptr_t)base + HMM_ALIGN + META_DATA_SIZE) & ~(uintptr_t)HMM_FLAGS_MASK) - META_DATA_SIZE);
     }
 
-    Head = (fnode*)programBreak;  // Set the head of the list to the start of the heap
-    Head->length = PAGE / 8;  // Set the initial block size
-    Head->prev = NULL;  // Set the previous pointer of the head to NULL
-    Head->next = NULL;  // Set the next pointer of the head to NULL
-    Tail = Head;  // Set the tail of the list to the head
-    insertend(1);
-    isFlistAvailable = 1;
+    fnode* head = (fnode*)heapBase;  // Set the head of the list to the start of the heap
+    head->length = (size_t)((char*)programBreak - (char*)heapBase) & ~HMM_FLAGS_MASK;  // The whole heap is one free block
+    heapEnd = (char*)heapBase + head->length;
+    head->prev = 0;  // Set the previous pointer of the head to none
+    head->next = 0;  // Set the next pointer of the head to none
+    mainList.head = NODE_OFFSET(&mainArena, head);
+    mainList.tail = mainList.head;  // Set the tail of the list to the head
+    __atomic_store_n(&isFlistAvailable, 1, __ATOMIC_RELEASE);
 }
 
 /* Adds a new free node after the given node */
-void* addafternode(fnode* node) {
+void* addafternode(hmmArena* arena, fnode* node) {
     size_t* pose = (size_t*)((char*)node + node->length);  // Calculate the position for the new node
     fnode* newNode = (fnode*)pose;  // Create new node at calculated position
     newNode->next = node->next;  // Set the next pointer of the new node
-    newNode->prev = node;  // Set the previous pointer of the new node
+    newNode->prev = NODE_OFFSET(arena, node);  // Set the previous pointer of the new node
 
-    if (node->next) { // Ensure node->next is not NULL
-        node->next->prev = newNode;  // Update the previous pointer of the next node
+    if (node->next) { // Ensure node->next is not none
+        NODE_AT(arena, node->next)->prev = NODE_OFFSET(arena, newNode);  // Update the previous pointer of the next node
     }
-    node->next = newNode;  // Set the next pointer of the given node to the new node
+    node->next = NODE_OFFSET(arena, newNode);  // Set the next pointer of the given node to the new node
     return newNode;
 }
 
 /* Splits a free node if it is larger than the requested block size */
-void split(fnode* node, size_t blockSize) {
+void split(hmmArena* arena, fnode* node, size_t blockSize) {
     size_t oldlength = node->length;  // Store the old length of the node
-    size_t minBlockSize = META_DATA_SIZE + 8; // Minimum block size to split
+    size_t minBlockSize = HMM_MIN_BLOCK; // Minimum block size to split
 
     if ((oldlength - blockSize) >= minBlockSize) {
-        // Adjust the current node's length
-        node->length = blockSize;
         // Create a new node with the remaining space
         fnode* newNode = (fnode*)((char*)node + blockSize);
         newNode->length = oldlength - blockSize;
         newNode->next = node->next;
-        newNode->prev = node;
+        newNode->prev = NODE_OFFSET(arena, node);
+
+        // Shrink the current node only once the remainder has a valid header, so that
+        // the block headers tile the heap at every point (see arenaRebuild)
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        node->length = blockSize;
 
         if (node->next) {
-            node->next->prev = newNode;
+            NODE_AT(arena, node->next)->prev = NODE_OFFSET(arena, newNode);
         }
-        node->next = newNode;
+        node->next = NODE_OFFSET(arena, newNode);
 
         // Update the tail if the new node is the new tail
-        if (node == Tail) {
-            Tail = newNode;
+        if (newNode->next == 0) {
+            arena->list->tail = node->next;
         }
     }
 }
 
+/* Unlinks a node from the free list */
+void removeNode(hmmArena* arena, fnode* node) {
+    if (node->prev) {
+        NODE_AT(arena, node->prev)->next = node->next;  // Update previous node's next pointer
+    } else {
+        arena->list->head = node->next;  // Update head if the node was the head
+    }
+    if (node->next) {
+        NODE_AT(arena, node->next)->prev = node->prev;  // Update next node's previous pointer
+    } else {
+        arena->list->tail = node->prev;  // Update tail if the node was the tail
+    }
+
+    node->next = 0;  // Clear the next link of the node
+    node->prev = 0;  // Clear the previous link of the node
+}
+
 /* Finding a free node that fits the requested block size using the first-fit strategy */
-void *firstFit(size_t blockSize) {
-    assert(Head != NULL);
-    fnode* curr = Head;
+void *firstFit(hmmArena* arena, size_t blockSize) {
+    fnode* curr = NODE_AT(arena, arena->list->head);
     while (curr) {
         if (curr->length >= blockSize) {
-            if (curr != Head && curr != Tail) {
-                split(curr, blockSize);  // Split the node if it is not the head or tail
-            }
+            split(arena, curr, blockSize);  // Give back whatever the request does not need
             return curr;  // Return the node that fits the requested block size
         }
-        curr = curr->next;
+        curr = NODE_AT(arena, curr->next);
     }
     return NULL;  // Return NULL if no suitable node is found
 }
 
 /* Adds a new free node after the Tail */
 int insertend(int pagesNeeded) {
-    // Ensure that the new node does not exceed the program Break edge
-
-    void* cbp = sbrk(pagesNeeded * PAGE);
+    size_t increment = (size_t)pagesNeeded * PAGE;
+    char* cbp = (char*)sbreak(increment);
     if (cbp == (void*)-1) return -1;
 
-    fnode* newNode = (fnode*)((char*)Tail + Tail->length);  // Position the new node after the tail
-    newNode->prev = Tail;  // Set the previous pointer of the new node to the old tail
-    Tail->next = newNode;  // Set the next pointer of the old tail to the new node
-    Tail = newNode;  // Update the tail to be the new node
-    Tail->next = NULL;  // Set the next pointer of the new tail to NULL
-    /* Set the length of the new node */
-    Tail->length = (size_t)((char*)cbp - (char*)Tail);  // Set the length of the new Tail-node
+    // Continue from the last block, unless someone else moved the break since we last grew
+    char* start = heapEnd;
+    if (cbp != (char*)programBreak) {
+        start = (char*)((((uintptr_t)cbp + META_DATA_SIZE + HMM_FLAGS_MASK) & ~(uintptr_t)HMM_FLAGS_MASK) - META_DATA_SIZE);
+    }
+    programBreak = (size_t*)(cbp + increment);
+    heapBytes += increment;
+
+    fnode* newNode = (fnode*)start;  // The new space lies above every existing block
+    newNode->length = (size_t)((char*)programBreak - start) & ~HMM_FLAGS_MASK;  // Set the length of the new Tail-node
+    heapEnd = start + newNode->length;
+    newNode->prev = mainList.tail;  // Set the previous pointer of the new node to the old tail
+    newNode->next = 0;  // The new node is the last one
+    if (mainList.tail) {
+        NODE_AT(&mainArena, mainList.tail)->next = NODE_OFFSET(&mainArena, newNode);  // Link the old tail to the new node
+    } else {
+        mainList.head = NODE_OFFSET(&mainArena, newNode);
+    }
+    mainList.tail = NODE_OFFSET(&mainArena, newNode);  // Update the tail to be the new node
 
-    mergeNodes();
+    mergeNodes(&mainArena);
     return 0;  // Success
 }
 
@@ -186,41 +452,396 @@ void HmmFree(void *ptr) {
 
     if (!isFlistAvailable) return;
 
-    fnode* blockToFree = (fnode*)((char*)ptr - sizeof(fnode));  // Get the free node from the pointer
+    fnode* blockToFree = (fnode*)((char*)ptr - META_DATA_SIZE);  // Get the free node from the pointer
+
+    int cls = blockClass(BLOCK_LENGTH(blockToFree) - META_DATA_SIZE);
+    if (cls >= 0 && percpuCacheFree(ptr, cls) == 0) {
+        return;  // Parked in this CPU's cache
+    }
+
+    if (scavengerActive()) {
+        // Leave the coalescing to the scavenger thread: push onto the deferred stack without locking
+        __atomic_fetch_add(&deferredBytes, BLOCK_LENGTH(blockToFree), __ATOMIC_RELAXED);  // Before the block can be drained
+        size_t head = __atomic_load_n(&deferredFrees, __ATOMIC_RELAXED);
+        do {
+            blockToFree->next = head;
+        } while (!__atomic_compare_exchange_n(&deferredFrees, &head, NODE_OFFSET(&mainArena, blockToFree), 1,
+                                              __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        return;
+    }
+
+    pthread_mutex_lock(&heapLock);
+    heapFree(blockToFree);
+    pthread_mutex_unlock(&heapLock);
+}
+
+/* Returns a block to a quick bin, or to the free list and coalesces. Caller holds heapLock. */
+static void heapFree(fnode *blockToFree) {
+    if (parkQuick(blockToFree)) {
+        return;
+    }
+    insertFree(&mainArena, blockToFree);
+    mergeNodes(&mainArena);  // Merge adjacent free nodes
+}
+
+/* Parks a small block in its quick bin without coalescing. Returns 0 if it does not qualify. */
+static int parkQuick(fnode *block) {
+    int cls = blockClass(BLOCK_LENGTH(block) - META_DATA_SIZE);
+    if (cls < 0 || !quickBinsEnabled) {
+        return 0;
+    }
+    block->next = quickBins[cls];
+    quickBins[cls] = NODE_OFFSET(&mainArena, block);
+    return 1;
+}
+
+/* Merges every quick bin into the free list. Returns 0 if they were all empty. Caller holds heapLock. */
+static int consolidateQuickBins(void) {
+    int moved = 0;
+    for (int cls = 0; cls < HMM_SIZE_CLASSES; ++cls) {
+        while (quickBins[cls]) {
+            fnode* block = NODE_AT(&mainArena, quickBins[cls]);
+            quickBins[cls] = block->next;
+            insertFree(&mainArena, block);
+            moved = 1;
+        }
+    }
+    if (moved) {
+        mergeNodes(&mainArena);
+        consolidations++;
+    }
+    return moved;
+}
+
+/* Links a block into the free list without merging */
+void insertFree(hmmArena* arena, fnode *blockToFree) {
+    // Keep the free list sorted by address so that mergeNodes() finds neighbours next to each other
+    size_t offset = NODE_OFFSET(arena, blockToFree);
+    size_t curr = arena->list->head;
+    while (curr && curr < offset) {
+        curr = NODE_AT(arena, curr)->next;
+    }
+    linkBefore(arena, blockToFree, curr);
+}
+
+/* Links a block into the free list in front of the node at offset `curr` (0: at the tail) */
+static void linkBefore(hmmArena* arena, fnode *blockToFree, size_t curr) {
+    size_t offset = NODE_OFFSET(arena, blockToFree);
+
+    blockToFree->length &= ~HMM_FLAGS_MASK;  // No longer in use
+    blockToFree->next = curr;
+    blockToFree->prev = curr ? NODE_AT(arena, curr)->prev : arena->list->tail;
+    if (blockToFree->prev) {
+        NODE_AT(arena, blockToFree->prev)->next = offset;
+    } else {
+        arena->list->head = offset;  // Update the head to the new block
+    }
+    if (curr) {
+        NODE_AT(arena, curr)->prev = offset;
+    } else {
+        arena->list->tail = offset;
+    }
+}
+
+/* Sorts a chain of main-heap blocks linked through fnode->next by address (merge sort) */
+static fnode *sortByAddress(fnode *chain) {
+    if (chain == NULL || chain->next == 0) {
+        return chain;
+    }
+
+    // Split the chain in halves
+    fnode* slow = chain;
+    fnode* fast = NODE_AT(&mainArena, chain->next);
+    while (fast && fast->next) {
+        slow = NODE_AT(&mainArena, slow->next);
+        fast = NODE_AT(&mainArena, NODE_AT(&mainArena, fast->next)->next);
+    }
+    fnode* left = chain;
+    fnode* right = NODE_AT(&mainArena, slow->next);
+    slow->next = 0;
+    left = sortByAddress(left);
+    right = sortByAddress(right);
+
+    size_t merged = 0;
+    size_t* link = &merged;
+    while (left && right) {
+        fnode** lower = (left < right) ? &left : &right;
+        *link = NODE_OFFSET(&mainArena, *lower);
+        link = &(*lower)->next;
+        *lower = NODE_AT(&mainArena, (*lower)->next);
+    }
+    *link = NODE_OFFSET(&mainArena, left ? left : right);
+    return NODE_AT(&mainArena, merged);
+}
+
+/* Non-zero once the deferred frees hold 1/HMM_DEFERRED_SHARE of the heap and at least HMM_DEFERRED_MIN bytes. Caller holds heapLock. */
+static int deferredOverLimit(void) {
+    size_t bytes = __atomic_load_n(&deferredBytes, __ATOMIC_RELAXED);
+    return bytes >= HMM_DEFERRED_MIN && bytes >= heapBytes / HMM_DEFERRED_SHARE;
+}
+
+/*
+ * Moves every deferred free onto the free list. Returns 0 if there were none.
+ * The batch is sorted by address first so that a single walk of the free list
+ * places all of it, instead of one walk per block. Caller holds heapLock.
+ */
+static int drainDeferred(void) {
+    size_t first = __atomic_exchange_n(&deferredFrees, 0, __ATOMIC_ACQUIRE);
+    fnode* block = NODE_AT(&mainArena, first);
+    if (block == NULL) {
+        return 0;
+    }
+
+    fnode* pending = NULL;
+    size_t drained = 0;
+    while (block) {
+        fnode* next = NODE_AT(&mainArena, block->next);
+        drained += BLOCK_LENGTH(block);
+        if (!parkQuick(block)) {
+            block->next = NODE_OFFSET(&mainArena, pending);
+            pending = block;
+        }
+        block = next;
+    }
+    __atomic_fetch_sub(&deferredBytes, drained, __ATOMIC_RELAXED);
+
+    size_t curr = mainList.head;
+    for (block = sortByAddress(pending); block; ) {
+        fnode* next = NODE_AT(&mainArena, block->next);
+        size_t offset = NODE_OFFSET(&mainArena, block);
+        while (curr && curr < offset) {
+            curr = NODE_AT(&mainArena, curr)->next;
+        }
+        linkBefore(&mainArena, block, curr);
+        block = next;
+    }
+    mergeNodes(&mainArena);  // One pass for the whole batch
+    return 1;
+}
+
+/* Returns blocks trimmed from the per-CPU caches to the free list */
+void heapFreeBlocks(void **ptrs, int count) {
+    if (count == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&heapLock);
+    for (int i = 0; i < count; ++i) {
+        fnode* block = (fnode*)((char*)ptrs[i] - META_DATA_SIZE);
+        if (!parkQuick(block)) {
+            insertFree(&mainArena, block);
+        }
+    }
+    mergeNodes(&mainArena);
+    pthread_mutex_unlock(&heapLock);
+}
+
+/* Page range of a free block that can be returned to the kernel; the page holding the node header stays */
+static size_t releasableRange(fnode* node, uintptr_t* start) {
+    uintptr_t pageSize = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t end = ((uintptr_t)node + node->length) & ~(pageSize - 1);
+
+    *start = ((uintptr_t)node + sizeof(fnode) + pageSize - 1) & ~(pageSize - 1);
+    return (end > *start) ? end - *start : 0;
+}
 
-    // Insert block into the free list
-    blockToFree->next = Head;  // Set the next pointer of the block to the current head
-    blockToFree->prev = NULL;  // Set the previous pointer of the block to NULL
-    if (Head) {
-        Head->prev = blockToFree;  // Update the previous pointer of the old head
+/*
+ * Background maintenance: coalesce deferred frees and give idle free pages
+ * back to the kernel. A run counts as idle once it is found unchanged (same
+ * offset and length) on two passes in a row; it is released then and again
+ * only every HMM_RELEASE_REPEAT passes while it stays unchanged. The runs are
+ * taken off the free list for the madvise() calls so that heapLock is not
+ * held across them; releaseLock is, so a fork waits until they are back.
+ * Called only by the scavenger thread, or once it is gone.
+ */
+void heapScavenge(void) {
+    static releaseRun runs[HMM_RELEASE_MAX_RUNS];  // Runs seen on the previous pass
+    static int runCount = 0;
+    releaseRun seen[HMM_RELEASE_MAX_RUNS];
+    fnode* taken[HMM_RELEASE_MAX_RUNS];
+    int seenCount = 0, takenCount = 0;
+
+    pthread_mutex_lock(&releaseLock);
+    pthread_mutex_lock(&heapLock);
+    drainDeferred();
+    for (fnode* curr = NODE_AT(&mainArena, mainList.head); curr && seenCount < HMM_RELEASE_MAX_RUNS;
+         curr = NODE_AT(&mainArena, curr->next)) {
+        uintptr_t start;
+        if (releasableRange(curr, &start) < HMM_RELEASE_MIN) {
+            continue;
+        }
+
+        releaseRun* run = &seen[seenCount++];
+        run->offset = NODE_OFFSET(&mainArena, curr);
+        run->length = curr->length;
+        run->age = 0;
+        for (int i = 0; i < runCount; ++i) {
+            if (runs[i].offset == run->offset && runs[i].length == run->length) {
+                run->age = runs[i].age + 1;
+                break;
+            }
+        }
+        if (run->age == 1 || (run->age > 0 && run->age % HMM_RELEASE_REPEAT == 0)) {
+            taken[takenCount++] = curr;
+        }
+    }
+    for (int i = 0; i < takenCount; ++i) {
+        removeNode(&mainArena, taken[i]);
+        taken[i]->length |= HMM_INUSE;  // Out of reach of allocations while its pages are released
     }
-    Head = blockToFree;  // Update the head to the new block
+    pthread_mutex_unlock(&heapLock);
 
-    mergeNodes();  // Merge adjacent free nodes
+    memcpy(runs, seen, seenCount * sizeof(releaseRun));
+    runCount = seenCount;
+    if (takenCount == 0) {
+        pthread_mutex_unlock(&releaseLock);
+        return;
+    }
+
+    for (int i = 0; i < takenCount; ++i) {
+        uintptr_t start;
+        size_t length = releasableRange(taken[i], &start);
+        madvise((void*)start, length, MADV_DONTNEED);
+    }
+
+    pthread_mutex_lock(&heapLock);
+    for (int i = 0; i < takenCount; ++i) {
+        insertFree(&mainArena, taken[i]);
+    }
+    mergeNodes(&mainArena);  // Neighbours freed meanwhile join the runs; a changed run starts aging again
+    pthread_mutex_unlock(&heapLock);
+    pthread_mutex_unlock(&releaseLock);
+}
+
+/*
+ * Startup prefaulting: grows the heap until at least `bytes` are free at its
+ * end, then faults in every free page so that later allocations take no page
+ * faults. Returns -1 if the heap cannot grow.
+ */
+int heapPrefault(size_t bytes) {
+    uintptr_t pageSize = (uintptr_t)sysconf(_SC_PAGESIZE);
+    int rc = 0;
+
+    if (!__atomic_load_n(&isFlistAvailable, __ATOMIC_ACQUIRE)) {
+        heapInit();
+    }
+
+    pthread_mutex_lock(&heapLock);
+    fnode* tail = NODE_AT(&mainArena, mainList.tail);
+    size_t available = (tail && (char*)tail + tail->length == heapEnd) ? tail->length : 0;
+    if (isHeapFull || (available < bytes && insertend((int)((bytes - available + PAGE - 1) / PAGE)) == -1)) {
+        rc = -1;
+    }
+
+    for (fnode* curr = NODE_AT(&mainArena, mainList.head); curr; curr = NODE_AT(&mainArena, curr->next)) {
+        uintptr_t start = (uintptr_t)curr & ~(pageSize - 1);
+        uintptr_t end = (uintptr_t)curr + curr->length;
+        if (madvise((void*)start, ((end + pageSize - 1) & ~(pageSize - 1)) - start, MADV_POPULATE_WRITE) == 0) {
+            continue;
+        }
+        // Kernels before 5.14: write one byte of each page back to itself, staying inside the free block
+        for (uintptr_t addr = (uintptr_t)curr; addr < end; addr = (addr & ~(pageSize - 1)) + pageSize) {
+            volatile char* byte = (volatile char*)addr;
+            *byte = *byte;
+        }
+    }
+    pthread_mutex_unlock(&heapLock);
+    return rc;
 }
 
 /* This function handles merging of adjacent free nodes */
-void mergeNodes(void) {
-    if (!Head || !(Head->next)) {
+void mergeNodes(hmmArena* arena) {
+    fnode* curr = NODE_AT(arena, arena->list->head);
+    if (!curr || !(curr->next)) {
         return;  // Nothing to merge
     }
 
-    fnode* curr = Head;
     while (curr && curr->next) {
-        if ((char*)curr + curr->length == (char*)curr->next) {
+        fnode* next = NODE_AT(arena, curr->next);
+        if ((char*)curr + curr->length == (char*)next) {
             // Merge adjacent nodes
-            curr->length += curr->next->length;
-            curr->next = curr->next->next;
+            curr->length += next->length;
+            curr->next = next->next;
             if (curr->next) {
-                curr->next->prev = curr;
+                NODE_AT(arena, curr->next)->prev = NODE_OFFSET(arena, curr);
             }
             else {
-                Tail = curr;  // Update Tail if the last node was merged
+                arena->list->tail = NODE_OFFSET(arena, curr);  // Update the tail if the last node was merged
             }
         } else {
-            curr = curr->next;  // Move to the next node
+            curr = next;  // Move to the next node
+        }
+    }
+}
+
+/*
+ * Rebuilds an arena's free list from the block headers between the offsets
+ * start and end, e.g. after a crash left the links half-updated. Adjacent
+ * free blocks are merged on the way. Returns -1 if a header is damaged.
+ */
+int arenaRebuild(hmmArena* arena, size_t start, size_t end) {
+    fnode* last = NULL;  // Last free node appended to the list
+
+    arena->list->head = 0;
+    arena->list->tail = 0;
+    for (size_t offset = start; offset < end; ) {
+        fnode* node = (fnode*)(arena->base + offset);
+        size_t length = BLOCK_LENGTH(node);
+        if (length < HMM_MIN_BLOCK || length > end - offset) {
+            return -1;
+        }
+
+        if (!(node->length & HMM_INUSE)) {
+            if (last && (char*)last + last->length == (char*)node) {
+                last->length += length;
+            } else {
+                node->length = length;
+                node->prev = NODE_OFFSET(arena, last);
+                node->next = 0;
+                if (last) {
+                    last->next = offset;
+                } else {
+                    arena->list->head = offset;
+                }
+                arena->list->tail = offset;
+                last = node;
+            }
+        }
+        offset += length;
+    }
+    return 0;
+}
+
+/* Snapshot of heap usage and quick bin counters */
+void HmmGetStats(hmmStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&heapLock);
+    stats->heapBytes = heapBytes;
+    for (fnode* curr = NODE_AT(&mainArena, mainList.head); curr; curr = NODE_AT(&mainArena, curr->next)) {
+        stats->freeBytes += curr->length;
+    }
+    for (int cls = 0; cls < HMM_SIZE_CLASSES; ++cls) {
+        for (fnode* curr = NODE_AT(&mainArena, quickBins[cls]); curr; curr = NODE_AT(&mainArena, curr->next)) {
+            stats->quickBinBytes += BLOCK_LENGTH(curr);
         }
     }
+    stats->quickHits = quickHits;
+    stats->quickMisses = quickMisses;
+    stats->consolidations = consolidations;
+    pthread_mutex_unlock(&heapLock);
+}
+
+void *HmmCalloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        return NULL;  // nmemb * size would overflow
+    }
+
+    void* ptr = HmmAlloc(nmemb * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, nmemb * size);  // Recycled blocks are not zeroed
+    }
+    return ptr;
 }
 
 void *HmmRealloc(void *ptr, size_t blockSize) {
@@ -233,13 +854,11 @@ void *HmmRealloc(void *ptr, size_t blockSize) {
         return NULL;
     }
 
-    fnode* oldBlock = (fnode*)((char*)ptr - sizeof(fnode));  // Get the old block
-    size_t oldSize = oldBlock->length;
+    fnode* oldBlock = (fnode*)((char*)ptr - META_DATA_SIZE);  // Get the old block
+    size_t oldSize = BLOCK_LENGTH(oldBlock) - META_DATA_SIZE;  // Usable bytes of the old block
 
     if (blockSize <= oldSize) {
-        // Block is large enough; split if there is excess space
-        split(oldBlock, blockSize);
-        return ptr;
+        return ptr;  // Block is already large enough
     }
 
     // Allocate new block
@@ -274,3 +893,4 @@ void* calloc(size_t nmemb, size_t size) {
 void* realloc(void* ptr, size_t size) {
     return HmmRealloc(ptr, size);
 }
+
@@ -7,29 +7,157 @@
 // Define the page size
 #define PAGE (4056)
 #define VHEAP_MAX_SIZE (1024 * 1024 * 1024)
-#define META_DATA_SIZE sizeof(fnode)
+#define META_DATA_SIZE sizeof(size_t)  // Allocated blocks carry only the length/flags word
 
-// Free node structure
+// Block layout: lengths are multiples of HMM_ALIGN and every block starts META_DATA_SIZE
+// bytes before an HMM_ALIGN boundary, so the payload is HMM_ALIGN-aligned
+#define HMM_ALIGN 16
+#define HMM_FLAGS_MASK ((size_t)HMM_ALIGN - 1)  // Low bits of the length word hold flags
+#define HMM_INUSE ((size_t)1)                   // Block is allocated (or parked in a cache)
+#define HMM_MIN_BLOCK ((sizeof(fnode) + HMM_FLAGS_MASK) & ~HMM_FLAGS_MASK)  // Room for the free-list links
+#define BLOCK_LENGTH(node) ((node)->length & ~HMM_FLAGS_MASK)
+
+// Small size classes served by the per-CPU caches and quick bins. The default table has one class per
+// granule (blocks of 32, 48, ..., 272 bytes); a table from HMM_CLASS_PROFILE may have up to
+// HMM_SIZE_CLASSES classes and serve requests of up to HMM_SMALL_MAX bytes.
+#define HMM_CLASS_GRANULE HMM_ALIGN
+#define HMM_DEFAULT_CLASSES 16
+#define HMM_DEFAULT_SMALL_MAX ((HMM_DEFAULT_CLASSES + 1) * HMM_CLASS_GRANULE - META_DATA_SIZE)
+#define HMM_SIZE_CLASSES 24                    // Most classes a table may have
+#define HMM_SMALL_MAX (1024 - META_DATA_SIZE)  // Largest request a class table may serve
+#define HMM_CLASS_GRANULES ((HMM_SMALL_MAX + META_DATA_SIZE) / HMM_CLASS_GRANULE + 1)
+#define HMM_CLASS_BUCKETS (HMM_SMALL_MAX + 2)  // Histogram: one count per small request size, one for the rest
+#define HMM_CLASS_SAMPLE_PERIOD 64             // Mean allocations between histogram samples
+#define HMM_CPU_CACHE_SLOTS 32  // Cached blocks per size class per CPU
+
+// Background scavenger
+#define HMM_SCAVENGER_DEFAULT_MS 10  // Wake-up period unless HMM_SCAVENGER_INTERVAL_MS is set
+#define HMM_RELEASE_MIN (64 * 1024)  // Smallest run of free pages worth returning to the kernel
+#define HMM_RELEASE_MAX_RUNS 64      // Free runs the scavenger tracks per pass
+#define HMM_RELEASE_REPEAT 100       // Passes after which an unchanged released run is released again
+#define HMM_DEFERRED_SHARE 2         // Allocation drains the deferred frees once they hold 1/2 of the heap...
+#define HMM_DEFERRED_MIN (1024 * 1024)  // ...and at least this many bytes
+#define HMM_REBALANCE_PASSES 100     // Passes between per-CPU cache trims (1 s at the default interval)
+
+// Persistent file-backed heaps
+#define HMM_HEAP_MAGIC 0x484d4d4845415031ULL  // "HMMHEAP1"
+#define HMM_HEAP_VERSION 2
+
+// Shared-memory heaps
+#define HMM_SHM_MAGIC 0x484d4d53484d4531ULL  // "HMMSHME1"
+#define HMM_SHM_VERSION 1
+
+// Free node structure; prev and next live in the payload and only mean something while the block is free.
+// Links are offsets from the owning arena's base (0 = none), so a mapped heap works at any address.
 typedef struct fnode {
-    size_t length;        // Length of the block
-    struct fnode *prev;   // Pointer to the previous free node
-    struct fnode *next;   // Pointer to the next free node
+    size_t length;  // Length of the block, including this word, plus flags
+    size_t prev;    // Offset of the previous free node
+    size_t next;    // Offset of the next free node
 } fnode;
 
+// Free list anchors; stored inside the mapping for file-backed heaps
+typedef struct hmmList {
+    size_t head;  // Offset of the first free node
+    size_t tail;  // Offset of the last free node
+} hmmList;
+
+// One heap region: the main sbrk heap or a mapped heap
+typedef struct hmmArena {
+    char* base;     // Every offset is relative to this address
+    hmmList* list;  // Free list of the region, sorted by address
+} hmmArena;
+
+#define NODE_AT(arena, off) ((off) ? (fnode*)((arena)->base + (off)) : (fnode*)NULL)
+#define NODE_OFFSET(arena, node) ((node) ? (size_t)((char*)(node) - (arena)->base) : (size_t)0)
+
+// Opaque handle of a file-backed heap (pheap.c)
+typedef struct hmmHeap hmmHeap;
+
+// Opaque handle of a shared-memory heap (shmheap.c)
+typedef struct hmmShm hmmShm;
+
+// Heap statistics, see HmmGetStats()
+typedef struct hmmStats {
+    size_t heapBytes;       // Bytes obtained with sbrk
+    size_t freeBytes;       // Bytes on the free list
+    size_t quickBinBytes;   // Bytes parked in quick bins
+    size_t quickHits;       // Small allocations served from a quick bin
+    size_t quickMisses;     // Small allocations that fell through to the free list
+    size_t consolidations;  // Quick bin merges done instead of growing the heap
+} hmmStats;
+
 // Function prototypes
 void* sbreak(size_t increment);
 void freeListInit(void);
 int insertend(int pagesNeeded);
-void mergeNodes(void);
-void* addafternode(fnode* node);
-void split(fnode* node, size_t blockSize);
-void* firstFit(size_t blockSize);
+void mergeNodes(hmmArena* arena);
+void* addafternode(hmmArena* arena, fnode* node);
+void split(hmmArena* arena, fnode* node, size_t blockSize);
+void removeNode(hmmArena* arena, fnode* node);
+void insertFree(hmmArena* arena, fnode* node);
+void* firstFit(hmmArena* arena, size_t blockSize);
+void* arenaAlloc(hmmArena* arena, size_t blockSize);
+void arenaFree(hmmArena* arena, void* ptr);
+int arenaRebuild(hmmArena* arena, size_t start, size_t end);
 void* HmmAlloc(size_t blockSize);
 void HmmFree(void* ptr);
 void* HmmCalloc(size_t nmemb, size_t size);
 void* HmmRealloc(void* ptr, size_t size);
+void HmmGetStats(hmmStats* stats);
 void printFreeList();
 void *refirstFit(size_t blockSize);
+void heapScavenge(void);
+void heapFreeBlocks(void** ptrs, int count);
+int heapPrefault(size_t bytes);
+
+// Size class helpers
+int sizeClass(size_t size);
+size_t classSize(int sizeClass);
+int blockClass(size_t usable);
+int classTableSet(const size_t* sizes, int count);
+int classTableGet(size_t* sizes);
+void classSampleStart(void);
+void classHistogram(size_t* counts);
+
+// Profile-driven size-class tuning (classes.c)
+void classTableLoad(void);
+void classProfileInit(void);
+int classTune(const size_t* counts, size_t* sizes);
+double classWaste(const size_t* counts, const size_t* sizes, int count);
+int classProfileWrite(const char* path, const size_t* sizes, int count, const size_t* counts);
+
+// Per-CPU front-end caches (percpu.c)
+void percpuInit(void);
+void* percpuCacheAlloc(int sizeClass);
+int percpuCacheFree(void* ptr, int sizeClass);
+int percpuCount(int cpu, int sizeClass);
+int percpuTrim(void** surplus, int keep, uint32_t classes);
+
+// Background scavenger (scavenger.c)
+void scavengerInit(void);
+void scavengerPoll(void);
+int scavengerActive(void);
+
+// Persistent file-backed heaps (pheap.c)
+hmmHeap* HmmHeapOpen(const char* path, size_t size);
+int HmmHeapClose(hmmHeap* heap);
+int HmmHeapSync(hmmHeap* heap);
+void* HmmHeapAlloc(hmmHeap* heap, size_t size);
+void HmmHeapFree(hmmHeap* heap, void* ptr);
+void* HmmHeapRoot(hmmHeap* heap);
+void HmmHeapSetRoot(hmmHeap* heap, void* ptr);
+size_t HmmHeapOffset(hmmHeap* heap, void* ptr);
+void* HmmHeapPtr(hmmHeap* heap, size_t offset);
+
+// Shared-memory heaps (shmheap.c)
+hmmShm* HmmShmCreate(const char* name, size_t size);
+hmmShm* HmmShmOpen(const char* name);
+void HmmShmClose(hmmShm* shm);
+size_t HmmShmAlloc(hmmShm* shm, size_t size);
+void HmmShmFree(hmmShm* shm, size_t offset);
+size_t HmmShmRecoveries(hmmShm* shm);
+void* HmmShmToPtr(hmmShm* shm, size_t offset);
+size_t HmmShmToOffset(hmmShm* shm, void* ptr);
 
 // Standard library function wrappers
 void* malloc(size_t size);
@@ -0,0 +1,303 @@
+/* percpu.c (Per-CPU front-end caches) */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "heap.h"
+
+/*
+ * Every CPU owns a small stack of free blocks per size class. Pushes and pops
+ * run inside a restartable sequence: if the thread is preempted, migrated or
+ * signalled before the final store, the kernel restarts it at the abort
+ * handler, so the fast path needs neither atomics nor locks. The memory held
+ * by the caches is bounded by the number of CPUs, not the number of threads.
+ * Without rseq (other architectures, old kernels) every request falls through
+ * to the locked free list in heap.c.
+ */
+
+#if defined(__x86_64__) && defined(__linux__) && defined(__NR_rseq)
+#define HMM_HAVE_RSEQ 1
+#include <linux/rseq.h>
+#if defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define HMM_GLIBC_RSEQ 1
+#endif
+#endif
+#ifndef RSEQ_SIG
+#define RSEQ_SIG 0x53053053
+#endif
+#endif
+
+typedef struct cpuCache {
+    intptr_t count[HMM_SIZE_CLASSES];                    // Cached blocks per class
+    void *slots[HMM_SIZE_CLASSES][HMM_CPU_CACHE_SLOTS];  // LIFO stacks of user pointers
+} __attribute__((aligned(64))) cpuCache;
+
+static cpuCache *cpuCaches = NULL;
+static long numCpus = 0;
+static int percpuEnabled = 0;
+static int percpuStarted = 0;
+
+#ifdef HMM_HAVE_RSEQ
+
+enum { RSEQ_DONE = 0, RSEQ_MISS = 1, RSEQ_ABORTED = 2 };
+
+/* 1 once this thread has a registered rseq area, -1 if registration failed */
+static __thread int rseqState __attribute__((tls_model("initial-exec")));
+static __thread struct rseq *rseqArea __attribute__((tls_model("initial-exec")));
+static __thread struct rseq ownRseq __attribute__((tls_model("initial-exec")));
+
+/* Returns this thread's rseq area, registering one on first use */
+static struct rseq *rseqCurrent(void) {
+    if (rseqState != 0) {
+        return rseqState > 0 ? rseqArea : NULL;
+    }
+
+    rseqState = -1;
+#ifdef HMM_GLIBC_RSEQ
+    if (__rseq_size > 0) {
+        // glibc has already registered an area for this thread; share it
+        char *tp;
+        __asm__ ("movq %%fs:0, %0" : "=r"(tp));
+        rseqArea = (struct rseq *)(tp + __rseq_offset);
+        rseqState = 1;
+        return rseqArea;
+    }
+#endif
+    ownRseq.cpu_id = RSEQ_CPU_ID_UNINITIALIZED;
+    if (syscall(__NR_rseq, &ownRseq, sizeof(ownRseq), 0, RSEQ_SIG) == 0) {
+        rseqArea = &ownRseq;
+        rseqState = 1;
+    }
+    return rseqState > 0 ? rseqArea : NULL;
+}
+
+/*
+ * Both sequences locate the current CPU's cache from rs->cpu_id inside the
+ * critical section; the commit is the single store to count[cls].
+ */
+#define RSEQ_CS_DESCRIPTOR                                          \
+    ".pushsection __rseq_cs, \"aw\"\n\t"                            \
+    ".balign 32\n\t"                                                \
+    ".Lcs%=:\n\t"                                                   \
+    ".long 0, 0\n\t"                                                \
+    ".quad .Lstart%=, .Lcommit%= - .Lstart%=, .Labort%=\n\t"        \
+    ".popsection\n\t"                                               \
+    ".pushsection __rseq_failure, \"ax\"\n\t"                       \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                                    \
+    ".long 0x53053053\n\t"                                          \
+    ".Labort%=:\n\t"                                                \
+    "movl $2, %k[status]\n\t"                                       \
+    "jmp .Ldone%=\n\t"                                              \
+    ".popsection\n\t"                                               \
+    "leaq .Lcs%=(%%rip), %%rax\n\t"                                 \
+    "movq %%rax, %c[csOff](%[rs])\n\t"
+
+static int rseqPop(struct rseq *rs, long cls, long keep, void **out) {
+    int status;
+    void *ptr;
+
+    __asm__ __volatile__ (
+        RSEQ_CS_DESCRIPTOR
+        ".Lstart%=:\n\t"
+        "movl %c[cpuOff](%[rs]), %%eax\n\t"
+        "cmpq %[ncpu], %%rax\n\t"
+        "jae .Lmiss%=\n\t"
+        "imulq %[stride], %%rax, %%rax\n\t"
+        "addq %[base], %%rax\n\t"                       // rax = this CPU's cache
+        "movq (%%rax,%[cls],8), %%rcx\n\t"              // rcx = count[cls]
+        "cmpq %[keep], %%rcx\n\t"
+        "jle .Lmiss%=\n\t"                              // Leave at least `keep` blocks behind
+        "subq $1, %%rcx\n\t"
+        "imulq %[nslots], %[cls], %[ptr]\n\t"
+        "addq %%rcx, %[ptr]\n\t"
+        "movq %c[slotsOff](%%rax,%[ptr],8), %[ptr]\n\t" // ptr = slots[cls][count - 1]
+        "movq %%rcx, (%%rax,%[cls],8)\n\t"              // commit: count[cls] = count - 1
+        ".Lcommit%=:\n\t"
+        "xorl %k[status], %k[status]\n\t"
+        "jmp .Ldone%=\n\t"
+        ".Lmiss%=:\n\t"
+        "movl $1, %k[status]\n\t"
+        ".Ldone%=:\n\t"
+        : [status] "=&r"(status), [ptr] "=&r"(ptr)
+        : [rs] "r"(rs), [cls] "r"(cls), [keep] "r"(keep), [base] "r"(cpuCaches), [ncpu] "r"(numCpus),
+          [stride] "i"(sizeof(cpuCache)), [nslots] "i"(HMM_CPU_CACHE_SLOTS),
+          [cpuOff] "i"(offsetof(struct rseq, cpu_id)), [csOff] "i"(offsetof(struct rseq, rseq_cs)),
+          [slotsOff] "i"(offsetof(cpuCache, slots))
+        : "rax", "rcx", "memory", "cc");
+
+    *out = ptr;
+    return status;
+}
+
+static int rseqPush(struct rseq *rs, long cls, void *ptr) {
+    int status;
+    long slot;
+
+    __asm__ __volatile__ (
+        RSEQ_CS_DESCRIPTOR
+        ".Lstart%=:\n\t"
+        "movl %c[cpuOff](%[rs]), %%eax\n\t"
+        "cmpq %[ncpu], %%rax\n\t"
+        "jae .Lmiss%=\n\t"
+        "imulq %[stride], %%rax, %%rax\n\t"
+        "addq %[base], %%rax\n\t"                       // rax = this CPU's cache
+        "movq (%%rax,%[cls],8), %%rcx\n\t"              // rcx = count[cls]
+        "cmpq %[nslots], %%rcx\n\t"
+        "jae .Lmiss%=\n\t"
+        "imulq %[nslots], %[cls], %[slot]\n\t"
+        "addq %%rcx, %[slot]\n\t"
+        "movq %[ptr], %c[slotsOff](%%rax,%[slot],8)\n\t" // slots[cls][count] = ptr
+        "addq $1, %%rcx\n\t"
+        "movq %%rcx, (%%rax,%[cls],8)\n\t"              // commit: count[cls] = count + 1
+        ".Lcommit%=:\n\t"
+        "xorl %k[status], %k[status]\n\t"
+        "jmp .Ldone%=\n\t"
+        ".Lmiss%=:\n\t"
+        "movl $1, %k[status]\n\t"
+        ".Ldone%=:\n\t"
+        : [status] "=&r"(status), [slot] "=&r"(slot)
+        : [rs] "r"(rs), [cls] "r"(cls), [ptr] "r"(ptr), [base] "r"(cpuCaches), [ncpu] "r"(numCpus),
+          [stride] "i"(sizeof(cpuCache)), [nslots] "i"(HMM_CPU_CACHE_SLOTS),
+          [cpuOff] "i"(offsetof(struct rseq, cpu_id)), [csOff] "i"(offsetof(struct rseq, rseq_cs)),
+          [slotsOff] "i"(offsetof(cpuCache, slots))
+        : "rax", "rcx", "memory", "cc");
+
+    return status;
+}
+
+#endif // HMM_HAVE_RSEQ
+
+/* Allocates one cache per possible CPU. HMM_PERCPU=0 disables the caches. */
+void percpuInit(void) {
+#ifdef HMM_HAVE_RSEQ
+    if (__atomic_exchange_n(&percpuStarted, 1, __ATOMIC_ACQ_REL)) {
+        return;  // Already set up (or being set up) by another thread
+    }
+
+    const char *env = getenv("HMM_PERCPU");
+    if (env && strcmp(env, "0") == 0) {
+        return;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (cpus < 1) {
+        return;
+    }
+
+    void *mem = mmap(NULL, (size_t)cpus * sizeof(cpuCache), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return;
+    }
+
+    cpuCaches = (cpuCache *)mem;
+    numCpus = cpus;
+    __atomic_store_n(&percpuEnabled, 1, __ATOMIC_RELEASE);
+#endif
+}
+
+/* Pops a cached block of the given class from this CPU's cache, or returns NULL */
+void *percpuCacheAlloc(int sizeClass) {
+#ifdef HMM_HAVE_RSEQ
+    if (!__atomic_load_n(&percpuEnabled, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    struct rseq *rs = rseqCurrent();
+    if (rs == NULL) {
+        return NULL;  // No rseq for this thread: use the locked path
+    }
+
+    for (;;) {
+        void *ptr;
+        int status = rseqPop(rs, sizeClass, 0, &ptr);
+        if (status != RSEQ_ABORTED) {
+            return status == RSEQ_DONE ? ptr : NULL;
+        }
+    }
+#else
+    (void)sizeClass;
+    return NULL;
+#endif
+}
+
+/* Pushes a block onto this CPU's cache. Returns 0 on success, -1 if the caller must free it. */
+int percpuCacheFree(void *ptr, int sizeClass) {
+#ifdef HMM_HAVE_RSEQ
+    if (!__atomic_load_n(&percpuEnabled, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+
+    struct rseq *rs = rseqCurrent();
+    if (rs == NULL) {
+        return -1;
+    }
+
+    for (;;) {
+        int status = rseqPush(rs, sizeClass, ptr);
+        if (status != RSEQ_ABORTED) {
+            return status == RSEQ_DONE ? 0 : -1;
+        }
+    }
+#else
+    (void)ptr;
+    (void)sizeClass;
+    return -1;
+#endif
+}
+
+/* Blocks cached for a class on a CPU, read from any thread; 0 for a CPU without a cache */
+int percpuCount(int cpu, int sizeClass) {
+    if (!__atomic_load_n(&percpuEnabled, __ATOMIC_ACQUIRE) || cpu < 0 || cpu >= numCpus) {
+        return 0;
+    }
+    return (int)__atomic_load_n(&cpuCaches[cpu].count[sizeClass], __ATOMIC_RELAXED);
+}
+
+/*
+ * Pops the blocks above `keep` in the classes of the current CPU's cache set
+ * in `classes` (bit per class) into `surplus` (room for HMM_SIZE_CLASSES *
+ * HMM_CPU_CACHE_SLOTS pointers) and returns how many were taken. The caller
+ * hands them back to the free list.
+ */
+int percpuTrim(void **surplus, int keep, uint32_t classes) {
+    int count = 0;
+#ifdef HMM_HAVE_RSEQ
+    if (!__atomic_load_n(&percpuEnabled, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    struct rseq *rs = rseqCurrent();
+    if (rs == NULL) {
+        return 0;
+    }
+
+    for (int cls = 0; cls < HMM_SIZE_CLASSES; ++cls) {
+        if (!(classes & (1u << cls))) {
+            continue;
+        }
+        for (;;) {
+            void *ptr;
+            int status = rseqPop(rs, cls, keep, &ptr);
+            if (status == RSEQ_MISS) {
+                break;
+            }
+            if (status == RSEQ_DONE) {
+                surplus[count++] = ptr;
+            }
+        }
+    }
+#else
+    (void)surplus;
+    (void)keep;
+    (void)classes;
+#endif
+    return count;
+}
@@ -0,0 +1,218 @@
+/* pheap.c (Persistent file-backed heaps) */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "heap.h"
+
+/*
+ * A file-backed heap is an arena whose base is the start of the mapping. The
+ * header at offset 0 holds the free-list anchors, and every link is an offset,
+ * so the heap can be mapped at any address after a restart and used at once:
+ * opening a cleanly closed heap touches nothing but the header. The dirty flag
+ * is set while the heap is open; finding it set on open means the last owner
+ * died without HmmHeapClose(), and the free list is rebuilt from the block
+ * headers (arenaRebuild) before the heap is handed out.
+ */
+
+typedef struct hmmHeapHeader {
+    uint64_t magic;      // HMM_HEAP_MAGIC, written last when a heap is created
+    uint32_t version;    // HMM_HEAP_VERSION
+    uint32_t dirty;      // Set while a process has the heap open
+    uint64_t size;       // Size of the file and of the mapping
+    uint64_t root;       // Offset of the application's root object, 0 if none
+    uint64_t heapStart;  // Offset of the first block
+    uint64_t heapEnd;    // Offset just past the last block
+    hmmList list;        // Free list of the heap
+} hmmHeapHeader;
+
+struct hmmHeap {
+    hmmArena arena;          // Base is the mapping, list points into the header
+    hmmHeapHeader* header;
+    size_t size;
+    int fd;
+    pthread_mutex_t lock;    // Serialises threads of this process
+};
+
+/* Lays out a fresh heap: the header followed by a single free block */
+static void heapFormat(hmmHeap* heap) {
+    hmmHeapHeader* header = heap->header;
+    size_t start = ((sizeof(hmmHeapHeader) + HMM_ALIGN + META_DATA_SIZE) & ~HMM_FLAGS_MASK) - META_DATA_SIZE;
+
+    memset(header, 0, sizeof(*header));
+    header->version = HMM_HEAP_VERSION;
+    header->size = heap->size;
+    header->heapStart = start;
+    header->heapEnd = start + ((heap->size - start) & ~HMM_FLAGS_MASK);
+
+    fnode* block = NODE_AT(&heap->arena, start);
+    block->length = header->heapEnd - start;
+    block->prev = 0;
+    block->next = 0;
+    header->list.head = start;
+    header->list.tail = start;
+
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    header->magic = HMM_HEAP_MAGIC;
+}
+
+/*
+ * Opens the heap stored in `path`, creating a `size`-byte file if it does not
+ * exist yet (an existing file keeps its size). A file whose magic was never
+ * written is one whose creation was interrupted, and it is formatted as if it
+ * were new. Only one process may have a heap open at a time. Returns NULL with
+ * errno set on failure.
+ */
+hmmHeap* HmmHeapOpen(const char* path, size_t size) {
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    struct stat st;
+    hmmHeap* heap = NULL;
+    void* map = MAP_FAILED;
+    int err = 0;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0) {
+        goto fail;
+    }
+
+    int created = (st.st_size == 0);
+    if (created) {
+        size = (size + pageSize - 1) & ~(pageSize - 1);
+        if (size < sizeof(hmmHeapHeader) + HMM_ALIGN + HMM_MIN_BLOCK) {
+            errno = EINVAL;
+            goto fail;
+        }
+        if (ftruncate(fd, (off_t)size) != 0) {
+            goto fail;
+        }
+    } else {
+        size = (size_t)st.st_size;
+    }
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        goto fail;
+    }
+
+    heap = HmmAlloc(sizeof(hmmHeap));
+    if (heap == NULL) {
+        errno = ENOMEM;
+        goto fail;
+    }
+    heap->header = (hmmHeapHeader*)map;
+    heap->arena.base = (char*)map;
+    heap->arena.list = &heap->header->list;
+    heap->size = size;
+    heap->fd = fd;
+    pthread_mutex_init(&heap->lock, NULL);
+
+    if (!created && heap->header->magic == 0) {
+        created = (size >= sizeof(hmmHeapHeader) + HMM_ALIGN + HMM_MIN_BLOCK);
+    }
+    if (created) {
+        heapFormat(heap);
+    } else {
+        hmmHeapHeader* header = heap->header;
+        if (header->magic != HMM_HEAP_MAGIC || header->version != HMM_HEAP_VERSION || header->size != size) {
+            errno = EINVAL;
+            goto fail;
+        }
+        if (header->dirty && arenaRebuild(&heap->arena, header->heapStart, header->heapEnd) != 0) {
+            errno = EIO;  // A block header is damaged beyond what the recovery walk can repair
+            goto fail;
+        }
+    }
+
+    // Mark the heap open before anything can change it
+    heap->header->dirty = 1;
+    msync(map, pageSize, MS_SYNC);
+    return heap;
+
+fail:
+    err = errno;
+    if (heap) {
+        pthread_mutex_destroy(&heap->lock);
+        HmmFree(heap);
+    }
+    if (map != MAP_FAILED) {
+        munmap(map, size);
+    }
+    close(fd);
+    errno = err;
+    return NULL;
+}
+
+/* Flushes the whole heap to the file; it stays open and dirty */
+int HmmHeapSync(hmmHeap* heap) {
+    pthread_mutex_lock(&heap->lock);
+    int rc = msync(heap->arena.base, heap->size, MS_SYNC);
+    pthread_mutex_unlock(&heap->lock);
+    return rc;
+}
+
+/* Flushes the heap, marks it clean and unmaps it. Pointers into the heap become invalid. */
+int HmmHeapClose(hmmHeap* heap) {
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    int rc = 0;
+
+    pthread_mutex_lock(&heap->lock);
+    if (msync(heap->arena.base, heap->size, MS_SYNC) != 0) {
+        rc = -1;  // Leave the heap dirty so the next open runs the recovery walk
+    } else {
+        heap->header->dirty = 0;
+        rc = msync(heap->arena.base, pageSize, MS_SYNC);
+    }
+    pthread_mutex_unlock(&heap->lock);
+
+    munmap(heap->arena.base, heap->size);
+    close(heap->fd);
+    pthread_mutex_destroy(&heap->lock);
+    HmmFree(heap);
+    return rc;
+}
+
+void* HmmHeapAlloc(hmmHeap* heap, size_t size) {
+    pthread_mutex_lock(&heap->lock);
+    void* ptr = arenaAlloc(&heap->arena, size);  // A mapped heap never grows
+    pthread_mutex_unlock(&heap->lock);
+    return ptr;
+}
+
+void HmmHeapFree(hmmHeap* heap, void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&heap->lock);
+    arenaFree(&heap->arena, ptr);
+    pthread_mutex_unlock(&heap->lock);
+}
+
+/* Returns the application's root object, or NULL if none was set */
+void* HmmHeapRoot(hmmHeap* heap) {
+    return HmmHeapPtr(heap, heap->header->root);
+}
+
+/* Records the application's root object so that it can be found again after reopening */
+void HmmHeapSetRoot(hmmHeap* heap, void* ptr) {
+    heap->header->root = HmmHeapOffset(heap, ptr);
+}
+
+/* Converts a pointer into the heap to an offset that stays valid across restarts */
+size_t HmmHeapOffset(hmmHeap* heap, void* ptr) {
+    return ptr ? (size_t)((char*)ptr - heap->arena.base) : 0;
+}
+
+/* Converts an offset from HmmHeapOffset() back to a pointer in the current mapping */
+void* HmmHeapPtr(hmmHeap* heap, size_t offset) {
+    return offset ? heap->arena.base + offset : NULL;
+}
@@ -0,0 +1,122 @@
+/* prewarm.c (Startup prefaulting and cache prewarming) */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include "heap.h"
+
+/*
+ * Without this hook the first allocation pays for freeListInit(), the per-CPU
+ * cache setup and the first page faults, and every growth of the heap faults
+ * again in the request path. When HMM_PREFAULT_MB or HMM_PREWARM_CLASSES is
+ * set, a constructor does all of that before main() runs:
+ *
+ *   HMM_PREFAULT_MB=64             grow the heap by 64 MB and fault it in
+ *   HMM_PREWARM_CLASSES=all        stock every size class on every CPU
+ *   HMM_PREWARM_CLASSES=72,200:32  stock the classes of 72 and 200 bytes,
+ *                                  the latter with 32 blocks per CPU
+ *
+ * With neither variable set the heap keeps initializing lazily.
+ */
+
+/* Blocks stocked per class and CPU unless a count is given; the scavenger trims to the same level */
+#define PREWARM_DEFAULT_BLOCKS (HMM_CPU_CACHE_SLOTS / 2)
+
+/* Parses HMM_PREWARM_CLASSES into blocks per size class. Returns 0 if nothing is to be stocked. */
+static int parseClasses(const char* spec, int counts[HMM_SIZE_CLASSES]) {
+    int any = 0;
+
+    memset(counts, 0, HMM_SIZE_CLASSES * sizeof(int));
+    if (strcmp(spec, "all") == 0) {
+        size_t sizes[HMM_SIZE_CLASSES];
+        int classes = classTableGet(sizes);
+        for (int cls = 0; cls < classes; ++cls) {
+            counts[cls] = PREWARM_DEFAULT_BLOCKS;
+        }
+        return 1;
+    }
+
+    while (*spec) {
+        char* end;
+        unsigned long size = strtoul(spec, &end, 10);
+        long count = PREWARM_DEFAULT_BLOCKS;
+        if (end == spec) {
+            break;  // Malformed: keep what was parsed so far
+        }
+        if (*end == ':') {
+            count = strtol(end + 1, &end, 10);
+        }
+
+        int cls = (size > 0) ? sizeClass(size) : -1;
+        if (cls >= 0 && count > 0) {
+            counts[cls] = (count > HMM_CPU_CACHE_SLOTS) ? HMM_CPU_CACHE_SLOTS : (int)count;
+            any = 1;
+        }
+
+        while (*end == ',' || isspace((unsigned char)*end)) {
+            end++;
+        }
+        spec = end;
+    }
+    return any;
+}
+
+/* Fills each CPU's cache by pinning this thread to it, allocating the blocks and freeing them there */
+static void prewarmCaches(const int counts[HMM_SIZE_CLASSES]) {
+    cpu_set_t original;
+    void* blocks[HMM_SIZE_CLASSES * HMM_CPU_CACHE_SLOTS];
+
+    if (sched_getaffinity(0, sizeof(original), &original) != 0) {
+        return;
+    }
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &original)) {
+            continue;
+        }
+
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        if (sched_setaffinity(0, sizeof(one), &one) != 0) {
+            continue;
+        }
+
+        // Allocate everything before freeing anything, or the allocations would pop the blocks just cached
+        int taken = 0;
+        for (int cls = 0; cls < HMM_SIZE_CLASSES; ++cls) {
+            for (int i = 0; i < counts[cls]; ++i) {
+                void* ptr = HmmAlloc(classSize(cls));
+                if (ptr) {
+                    blocks[taken++] = ptr;
+                }
+            }
+        }
+        while (taken > 0) {
+            HmmFree(blocks[--taken]);
+        }
+    }
+
+    sched_setaffinity(0, sizeof(original), &original);
+}
+
+__attribute__((constructor))
+static void prewarmInit(void) {
+    const char* prefault = getenv("HMM_PREFAULT_MB");
+    const char* classes = getenv("HMM_PREWARM_CLASSES");
+    int counts[HMM_SIZE_CLASSES];
+
+    long megabytes = prefault ? atol(prefault) : 0;
+
+    if (megabytes <= 0 && classes == NULL) {
+        return;
+    }
+
+    // Also sets up the heap and its class table, which parseClasses() needs
+    heapPrefault(megabytes > 0 ? (size_t)megabytes * 1024 * 1024 : 0);
+    if (classes && parseClasses(classes, counts)) {
+        prewarmCaches(counts);
+    }
+}
@@ -0,0 +1,251 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "heap.h"
+
+/* Define testing parameters */
+#define HEAP_SIZE (4 * 1024 * 1024) /* Size of the file-backed heap */
+#define NUM_NODES 1000 /* Nodes of the list reachable from the root slot */
+#define NUM_KILLS 20 /* Children killed in the middle of allocating and freeing */
+#define CHILD_BLOCKS 16 /* Blocks a child holds at most; they leak when it dies */
+#define MAX_SIZE 4096 /* Largest block a child allocates */
+#define PROBE_SIZE 1024 /* Block size used to measure how much of a heap can be allocated */
+#define SHM_SIZE (16 * 1024 * 1024) /* Size of the shared heap */
+#define MAX_LOCK_KILLS 100 /* Children killed at most until one dies holding the shared heap's lock */
+#define LOCK_TIMEOUT 10 /* Seconds before a lock a dead child left behind counts as a hang */
+
+typedef struct Node {
+    size_t next;  /* Offset of the next node, 0 at the end */
+    size_t value;
+} Node;
+
+static int failures = 0;
+
+static void check(int ok, const char* what) {
+    if (!ok) {
+        fprintf(stderr, "FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+/* Builds a list of NUM_NODES nodes and records its head in the root slot */
+static void buildList(hmmHeap* heap) {
+    size_t head = 0;
+
+    for (size_t i = NUM_NODES; i > 0; --i) {
+        Node* node = HmmHeapAlloc(heap, sizeof(Node));
+        if (node == NULL) {
+            check(0, "allocate a list node");
+            return;
+        }
+        node->next = head;
+        node->value = i - 1;
+        head = HmmHeapOffset(heap, node);
+    }
+    HmmHeapSetRoot(heap, HmmHeapPtr(heap, head));
+}
+
+/* Walks the list from the root slot. Returns 1 if it holds exactly the nodes buildList() made. */
+static int checkList(hmmHeap* heap) {
+    size_t count = 0;
+
+    for (Node* node = HmmHeapRoot(heap); node; node = HmmHeapPtr(heap, node->next)) {
+        if (node->value != count++) {
+            return 0;
+        }
+    }
+    return count == NUM_NODES;
+}
+
+/* Bytes that can still be allocated from the heap in PROBE_SIZE blocks; frees them again */
+static size_t heapCapacity(hmmHeap* heap) {
+    static void* blocks[HEAP_SIZE / PROBE_SIZE];
+    size_t count = 0;
+
+    while (count < HEAP_SIZE / PROBE_SIZE && (blocks[count] = HmmHeapAlloc(heap, PROBE_SIZE)) != NULL) {
+        count++;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        HmmHeapFree(heap, blocks[i]);
+    }
+    return count * PROBE_SIZE;
+}
+
+/* Allocates and frees until it is killed; never returns */
+static void churn(const char* path) {
+    void* blocks[CHILD_BLOCKS] = {NULL};
+    unsigned int seed = (unsigned int)getpid();
+
+    hmmHeap* heap = HmmHeapOpen(path, HEAP_SIZE);
+    if (heap == NULL) {
+        _exit(1);
+    }
+    for (;;) {
+        int index = rand_r(&seed) % CHILD_BLOCKS;
+        if (blocks[index] == NULL) {
+            blocks[index] = HmmHeapAlloc(heap, (size_t)(rand_r(&seed) % MAX_SIZE) + 1);
+        } else {
+            HmmHeapFree(heap, blocks[index]);
+            blocks[index] = NULL;
+        }
+    }
+}
+
+/* Bytes that can still be allocated from the shared heap in PROBE_SIZE blocks; frees them again */
+static size_t shmCapacity(hmmShm* shm) {
+    static size_t blocks[SHM_SIZE / PROBE_SIZE];
+    size_t count = 0;
+
+    while (count < SHM_SIZE / PROBE_SIZE && (blocks[count] = HmmShmAlloc(shm, PROBE_SIZE)) != 0) {
+        count++;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        HmmShmFree(shm, blocks[i]);
+    }
+    return count * PROBE_SIZE;
+}
+
+/* Allocates and frees in the shared heap until it is killed, holding its lock most of the time */
+static void shmChurn(hmmShm* shm) {
+    size_t blocks[CHILD_BLOCKS] = {0};
+    unsigned int seed = (unsigned int)getpid();
+
+    for (;;) {
+        int index = rand_r(&seed) % CHILD_BLOCKS;
+        if (blocks[index] == 0) {
+            blocks[index] = HmmShmAlloc(shm, (size_t)(rand_r(&seed) % MAX_SIZE) + 1);
+        } else {
+            HmmShmFree(shm, blocks[index]);
+            blocks[index] = 0;
+        }
+    }
+}
+
+/* A new file gets a list through the root slot; a clean reopen finds it */
+static void testRootReopen(const char* path) {
+    hmmHeap* heap = HmmHeapOpen(path, HEAP_SIZE);
+    check(heap != NULL, "create the heap");
+    if (heap == NULL) {
+        return;
+    }
+    buildList(heap);
+    check(HmmHeapClose(heap) == 0, "close the heap");
+
+    heap = HmmHeapOpen(path, HEAP_SIZE);
+    check(heap != NULL, "reopen the heap");
+    if (heap) {
+        check(checkList(heap), "find the list through the root slot after reopening");
+        HmmHeapClose(heap);
+    }
+}
+
+/* A file that was sized but never formatted, as left by a crash during creation, is formatted on open */
+static void testInterruptedCreate(const char* path) {
+    check(truncate(path, 0) == 0 && truncate(path, HEAP_SIZE) == 0, "leave an unformatted heap file");
+
+    hmmHeap* heap = HmmHeapOpen(path, HEAP_SIZE);
+    check(heap != NULL, "open a heap whose creation was interrupted");
+    if (heap) {
+        check(HmmHeapRoot(heap) == NULL, "start an interrupted heap without a root");
+        check(heapCapacity(heap) > HEAP_SIZE / 2, "allocate from an interrupted heap");
+        buildList(heap);
+        HmmHeapClose(heap);
+    }
+}
+
+/* Children killed mid alloc/free leave a dirty heap; each reopen must rebuild it and hand its blocks out again */
+static void testKilledChildren(const char* path) {
+    hmmHeap* heap = HmmHeapOpen(path, HEAP_SIZE);
+    check(heap != NULL, "open the heap before the children");
+    if (heap == NULL) {
+        return;
+    }
+    size_t baseline = heapCapacity(heap);
+    HmmHeapClose(heap);
+
+    for (int round = 1; round <= NUM_KILLS; ++round) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            churn(path);
+        }
+        usleep(1000 + (useconds_t)(round % 5) * 1000);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+
+        heap = HmmHeapOpen(path, HEAP_SIZE);
+        check(heap != NULL, "reopen the heap after a child was killed");
+        if (heap == NULL) {
+            return;
+        }
+        check(checkList(heap), "keep the list intact across a killed child");
+
+        // Each child leaks what it held; everything it had freed must be allocatable again
+        size_t leaked = (size_t)round * CHILD_BLOCKS * (MAX_SIZE + 2 * PROBE_SIZE);
+        check(heapCapacity(heap) + leaked >= baseline, "reuse the blocks a killed child had freed");
+        HmmHeapClose(heap);
+    }
+}
+
+/*
+ * Children killed while they churn a shared heap; at least one of them must
+ * die holding its lock. The parent must still get the lock and allocate, and
+ * only what the dead child held may be lost. A lock that is never recovered
+ * hangs the parent, which the alarm turns into a failure.
+ */
+static void testKilledLockHolder(void) {
+    hmmShm* shm = HmmShmCreate(NULL, SHM_SIZE);
+    check(shm != NULL, "create the shared heap");
+    if (shm == NULL) {
+        return;
+    }
+    size_t capacity = shmCapacity(shm);
+
+    alarm(LOCK_TIMEOUT);
+    for (int round = 1; round <= MAX_LOCK_KILLS && HmmShmRecoveries(shm) == 0; ++round) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            shmChurn(shm);
+        }
+        usleep(1000 + (useconds_t)(round % 5) * 1000);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+
+        size_t offset = HmmShmAlloc(shm, PROBE_SIZE);
+        check(offset != 0, "allocate from the shared heap after a child was killed");
+        HmmShmFree(shm, offset);
+
+        size_t now = shmCapacity(shm);
+        check(now + CHILD_BLOCKS * (MAX_SIZE + 2 * PROBE_SIZE) >= capacity, "lose only the blocks a killed child held");
+        capacity = now;
+    }
+    alarm(0);
+
+    check(HmmShmRecoveries(shm) > 0, "kill a child while it holds the shared heap's lock");
+    HmmShmClose(shm);
+}
+
+int main() {
+    char path[] = "/tmp/hmm_recovery_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    printf("Reopening a heap through its root slot...\n");
+    testRootReopen(path);
+    printf("Opening a heap whose creation was interrupted...\n");
+    testInterruptedCreate(path);
+    printf("Killing %d children in the middle of allocating and freeing...\n", NUM_KILLS);
+    testKilledChildren(path);
+
+    unlink(path);
+
+    printf("Killing children while they hold the shared heap's lock...\n");
+    testKilledLockHolder();
+    printf("%s\n", failures ? "Test failed." : "Test complete.");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,195 @@
+/* scavenger.c (Background maintenance thread) */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "heap.h"
+
+/*
+ * With HMM_SCAVENGER=1, HmmFree only pushes blocks onto a lock-free stack and
+ * this thread does the coalescing every HMM_SCAVENGER_INTERVAL_MS. On each
+ * pass it also returns the pages of idle free runs to the kernel, and every
+ * HMM_REBALANCE_PASSES passes it trims idle per-CPU caches back to half so
+ * that surplus blocks become available to the other CPUs. A forked child
+ * restarts the thread on its next allocation.
+ */
+
+static int scavengerWanted = 0;    // HMM_SCAVENGER=1
+static int scavengerRunning = 0;   // Thread is up; HmmFree defers to it
+static int scavengerStarting = 0;  // Guards against concurrent starts
+static int scavengerStopping = 0;
+static int scavengerAtexit = 0;
+static long scavengerIntervalMs = HMM_SCAVENGER_DEFAULT_MS;
+static pthread_t scavengerThread;
+static pthread_mutex_t scavengerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scavengerWake = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Every HMM_REBALANCE_PASSES passes, trims the classes of each CPU's cache that
+ * sat above half full without changing since the previous round, so blocks a
+ * CPU no longer uses become available to the others. The counts are read
+ * remotely; the thread pins itself only to CPUs that have such a class.
+ */
+static void rebalanceCaches(void) {
+    static int passes = 0;
+    static unsigned char lastCounts[CPU_SETSIZE][HMM_SIZE_CLASSES];  // Counts seen on the previous round
+    cpu_set_t original;
+    void* surplus[HMM_SIZE_CLASSES * HMM_CPU_CACHE_SLOTS];
+    int pinned = 0;
+
+    if (++passes < HMM_REBALANCE_PASSES) {
+        return;
+    }
+    passes = 0;
+    if (sched_getaffinity(0, sizeof(original), &original) != 0) {
+        return;
+    }
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &original)) {
+            continue;
+        }
+
+        uint32_t idle = 0;
+        for (int cls = 0; cls < HMM_SIZE_CLASSES; ++cls) {
+            int count = percpuCount(cpu, cls);
+            if (count > HMM_CPU_CACHE_SLOTS / 2 && count == lastCounts[cpu][cls]) {
+                idle |= 1u << cls;
+            }
+            lastCounts[cpu][cls] = (unsigned char)count;
+        }
+        if (idle == 0) {
+            continue;
+        }
+
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        if (sched_setaffinity(0, sizeof(one), &one) != 0) {
+            continue;
+        }
+        pinned = 1;
+
+        heapFreeBlocks(surplus, percpuTrim(surplus, HMM_CPU_CACHE_SLOTS / 2, idle));
+    }
+
+    if (pinned) {
+        sched_setaffinity(0, sizeof(original), &original);
+    }
+}
+
+static void* scavengerMain(void* arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&scavengerLock);
+    while (!scavengerStopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += scavengerIntervalMs / 1000;
+        deadline.tv_nsec += (scavengerIntervalMs % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_cond_timedwait(&scavengerWake, &scavengerLock, &deadline);
+        if (scavengerStopping) {
+            break;
+        }
+
+        pthread_mutex_unlock(&scavengerLock);
+        heapScavenge();
+        rebalanceCaches();
+        pthread_mutex_lock(&scavengerLock);
+    }
+    pthread_mutex_unlock(&scavengerLock);
+    return NULL;
+}
+
+/* Stops the thread at exit and coalesces whatever it left behind */
+static void scavengerShutdown(void) {
+    if (!__atomic_load_n(&scavengerRunning, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    __atomic_store_n(&scavengerWanted, 0, __ATOMIC_RELEASE);  // Late frees during exit stay synchronous
+    pthread_mutex_lock(&scavengerLock);
+    scavengerStopping = 1;
+    pthread_cond_signal(&scavengerWake);
+    pthread_mutex_unlock(&scavengerLock);
+
+    pthread_join(scavengerThread, NULL);
+    __atomic_store_n(&scavengerRunning, 0, __ATOMIC_RELEASE);
+    heapScavenge();
+}
+
+static void scavengerForkPrepare(void) {
+    pthread_mutex_lock(&scavengerLock);
+}
+
+static void scavengerForkParent(void) {
+    pthread_mutex_unlock(&scavengerLock);
+}
+
+static void scavengerForkChild(void) {
+    // Only the forking thread survives; frees go straight to the free list until scavengerPoll() restarts the thread
+    pthread_mutex_unlock(&scavengerLock);
+    scavengerRunning = 0;
+    scavengerStarting = 0;
+    scavengerStopping = 0;
+}
+
+/* Reads HMM_SCAVENGER and HMM_SCAVENGER_INTERVAL_MS. Called once from heap initialization. */
+void scavengerInit(void) {
+    const char* env = getenv("HMM_SCAVENGER");
+    if (env == NULL || strcmp(env, "1") != 0) {
+        return;
+    }
+
+    const char* interval = getenv("HMM_SCAVENGER_INTERVAL_MS");
+    if (interval != NULL && atol(interval) > 0) {
+        scavengerIntervalMs = atol(interval);
+    }
+
+    pthread_atfork(scavengerForkPrepare, scavengerForkParent, scavengerForkChild);
+    __atomic_store_n(&scavengerWanted, 1, __ATOMIC_RELEASE);
+}
+
+/* Starts the thread if it is wanted and not running. Called from the allocation slow path. */
+void scavengerPoll(void) {
+    if (!__atomic_load_n(&scavengerWanted, __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&scavengerRunning, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    if (__atomic_exchange_n(&scavengerStarting, 1, __ATOMIC_ACQ_REL)) {
+        return;  // Another thread (or pthread_create's own allocations) got here first
+    }
+
+    // Keep signals away from the maintenance thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int rc = pthread_create(&scavengerThread, NULL, scavengerMain, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (rc != 0) {
+        __atomic_store_n(&scavengerWanted, 0, __ATOMIC_RELEASE);  // Fall back to synchronous coalescing
+        return;
+    }
+
+    __atomic_store_n(&scavengerRunning, 1, __ATOMIC_RELEASE);
+    if (!scavengerAtexit) {
+        scavengerAtexit = 1;
+        atexit(scavengerShutdown);
+    }
+}
+
+/* Non-zero while HmmFree should defer coalescing to the scavenger thread */
+int scavengerActive(void) {
+    return __atomic_load_n(&scavengerRunning, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,251 @@
+/* shmheap.c (Shared-memory heaps for zero-copy message passing) */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "heap.h"
+
+/*
+ * A shared heap is an arena placed in a shm_open() or memfd region that
+ * several processes map, each at its own address. Like a file-backed heap it
+ * keeps its free-list anchors in a header at offset 0 and links free blocks by
+ * offset, so allocations are handed between processes as offsets and no
+ * process ever sees another's pointers. The free list is guarded by a robust
+ * process-shared mutex in the header: if a process dies holding it, the next
+ * locker rebuilds the free list from the block headers (arenaRebuild) and
+ * carries on. Blocks the dead process had allocated but not passed on leak.
+ */
+
+typedef struct hmmShmHeader {
+    uint64_t magic;        // HMM_SHM_MAGIC, written last when the heap is created
+    uint32_t version;      // HMM_SHM_VERSION
+    uint32_t recoveries;   // Times a process died holding the lock and the free list was rebuilt
+    uint64_t size;         // Size of the region
+    uint64_t heapStart;    // Offset of the first block
+    uint64_t heapEnd;      // Offset just past the last block
+    hmmList list;          // Free list of the heap
+    pthread_mutex_t lock;  // Robust, process-shared
+} hmmShmHeader;
+
+struct hmmShm {
+    hmmArena arena;  // Base is this process's mapping, list points into the header
+    hmmShmHeader* header;
+    size_t size;
+    int fd;
+};
+
+/* Maps `fd` and allocates the process-local handle, or returns NULL with errno set */
+static hmmShm* shmMap(int fd, size_t size) {
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    hmmShm* shm = HmmAlloc(sizeof(hmmShm));
+    if (shm == NULL) {
+        munmap(map, size);
+        errno = ENOMEM;
+        return NULL;
+    }
+    shm->header = (hmmShmHeader*)map;
+    shm->arena.base = (char*)map;
+    shm->arena.list = &shm->header->list;
+    shm->size = size;
+    shm->fd = fd;
+    return shm;
+}
+
+/* Lays out a fresh heap: the header, its mutex and a single free block */
+static int shmFormat(hmmShm* shm) {
+    hmmShmHeader* header = shm->header;
+    size_t start = ((sizeof(hmmShmHeader) + HMM_ALIGN + META_DATA_SIZE) & ~HMM_FLAGS_MASK) - META_DATA_SIZE;
+    pthread_mutexattr_t attr;
+
+    memset(header, 0, sizeof(*header));
+    header->version = HMM_SHM_VERSION;
+    header->size = shm->size;
+    header->heapStart = start;
+    header->heapEnd = start + ((shm->size - start) & ~HMM_FLAGS_MASK);
+
+    if (pthread_mutexattr_init(&attr) != 0) {
+        return -1;
+    }
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int rc = pthread_mutex_init(&header->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+
+    fnode* block = NODE_AT(&shm->arena, start);
+    block->length = header->heapEnd - start;
+    block->prev = 0;
+    block->next = 0;
+    header->list.head = start;
+    header->list.tail = start;
+
+    __atomic_store_n(&header->magic, HMM_SHM_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Takes the heap's mutex. If its previous owner died mid-update, the free list
+ * is rebuilt before the mutex is marked consistent again; a heap whose block
+ * headers are damaged leaves the mutex unrecoverable and every later call fails.
+ */
+static int shmLock(hmmShm* shm) {
+    hmmShmHeader* header = shm->header;
+
+    int rc = pthread_mutex_lock(&header->lock);
+    if (rc == EOWNERDEAD) {
+        if (arenaRebuild(&shm->arena, header->heapStart, header->heapEnd) != 0) {
+            pthread_mutex_unlock(&header->lock);
+            return ENOTRECOVERABLE;
+        }
+        header->recoveries++;
+        pthread_mutex_consistent(&header->lock);
+        rc = 0;
+    }
+    return rc;
+}
+
+/*
+ * Creates a shared heap of `size` bytes. With a name the region is a POSIX
+ * shared memory object that other processes attach with HmmShmOpen(); the name
+ * must not exist yet and stays until shm_unlink(). With a NULL name it is an
+ * anonymous memfd, shared with the children forked after this call, which use
+ * the same handle. Returns NULL with errno set on failure.
+ */
+hmmShm* HmmShmCreate(const char* name, size_t size) {
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    int fd;
+
+    size = (size + pageSize - 1) & ~(pageSize - 1);
+    if (size < sizeof(hmmShmHeader) + HMM_ALIGN + HMM_MIN_BLOCK) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (name) {
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    } else {
+        fd = memfd_create("hmm-shm", MFD_CLOEXEC);
+    }
+    if (fd < 0) {
+        return NULL;
+    }
+
+    hmmShm* shm = NULL;
+    if (ftruncate(fd, (off_t)size) == 0) {
+        shm = shmMap(fd, size);
+    }
+    if (shm == NULL || shmFormat(shm) != 0) {
+        int err = errno;
+        if (shm) {
+            munmap(shm->arena.base, size);
+            HmmFree(shm);
+        }
+        if (name) {
+            shm_unlink(name);
+        }
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    return shm;
+}
+
+/*
+ * Attaches to a heap made by HmmShmCreate() in another process. Fails with
+ * EAGAIN if the creator has not finished laying it out yet.
+ */
+hmmShm* HmmShmOpen(const char* name) {
+    struct stat st;
+
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    if ((size_t)st.st_size < sizeof(hmmShmHeader)) {
+        close(fd);
+        errno = EAGAIN;  // Not sized by its creator yet
+        return NULL;
+    }
+
+    hmmShm* shm = shmMap(fd, (size_t)st.st_size);
+    if (shm == NULL) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+
+    hmmShmHeader* header = shm->header;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != HMM_SHM_MAGIC ||
+        header->version != HMM_SHM_VERSION || header->size != shm->size) {
+        int err = (header->magic == 0) ? EAGAIN : EINVAL;
+        HmmShmClose(shm);
+        errno = err;
+        return NULL;
+    }
+    return shm;
+}
+
+/* Unmaps the heap from this process. The heap itself lives on in the other processes. */
+void HmmShmClose(hmmShm* shm) {
+    munmap(shm->arena.base, shm->size);
+    close(shm->fd);
+    HmmFree(shm);
+}
+
+/* Allocates `size` bytes and returns their offset, or 0 if the heap is full */
+size_t HmmShmAlloc(hmmShm* shm, size_t size) {
+    if (shmLock(shm) != 0) {
+        return 0;
+    }
+    void* ptr = arenaAlloc(&shm->arena, size);  // A shared heap never grows
+    pthread_mutex_unlock(&shm->header->lock);
+    return NODE_OFFSET(&shm->arena, ptr);
+}
+
+/* Frees an allocation by offset; any process attached to the heap may free it */
+void HmmShmFree(hmmShm* shm, size_t offset) {
+    hmmShmHeader* header = shm->header;
+
+    if (offset <= header->heapStart || offset >= header->heapEnd) {
+        return;  // 0 or not an offset into this heap
+    }
+    if (shmLock(shm) != 0) {
+        return;
+    }
+    arenaFree(&shm->arena, shm->arena.base + offset);
+    pthread_mutex_unlock(&header->lock);
+}
+
+/* Returns how many times a process died holding the heap's lock and the free list had to be rebuilt */
+size_t HmmShmRecoveries(hmmShm* shm) {
+    return __atomic_load_n(&shm->header->recoveries, __ATOMIC_RELAXED);
+}
+
+/* Converts an offset to a pointer in this process's mapping */
+void* HmmShmToPtr(hmmShm* shm, size_t offset) {
+    return offset ? shm->arena.base + offset : NULL;
+}
+
+/* Converts a pointer in this process's mapping to an offset other processes can use */
+size_t HmmShmToOffset(hmmShm* shm, void* ptr) {
+    return ptr ? (size_t)((char*)ptr - shm->arena.base) : 0;
+}